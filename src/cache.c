@@ -22,6 +22,12 @@
  */
 
 #include <glib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "internal.h"
 #include "cache.h"
 #include "config.h"
@@ -67,12 +73,15 @@ static gboolean
 cache_read_string (FILE *f, gchar **value)
 {
 	gboolean retval = FALSE;
-	gchar size;
+	gchar byte;
+	guchar size;
 
-	retval = cache_read_byte (f, &size);
+	retval = cache_read_byte (f, &byte);
 	if (retval == FALSE)
 		return FALSE;
 
+	size = (guchar) byte;
+
 	if (size == 0)
 	{
 		*value = NULL;
@@ -116,10 +125,10 @@ cache_read_version (FILE *f)
 	if (cache_read_byte (f, &version) == FALSE)
 		return FALSE;
 
-	if (version != CACHE_VERSION)
+	if (version != CACHE_VERSION_0)
 	{
 		g_warning ("Mismatch version %d (found) vs %d (expected)", 
-				version, CACHE_VERSION);
+				version, CACHE_VERSION_0);
 		return FALSE;
 	}
 
@@ -137,7 +146,7 @@ cache_get_languages (FILE *f)
 	if (cache_read_byte (f, &num_languages) == FALSE)
 		return retval;
 
-	for (i = 0; i < num_languages; i ++)
+	for (i = 0; i < (guchar) num_languages; i ++)
 	{
 		if (cache_read_string (f, &s) == TRUE)
 		{
@@ -260,7 +269,7 @@ cache_get_number_of_plugins (FILE *f)
 	if (cache_read_byte (f, &retval) == FALSE)
 		return 0;
 
-	return (gint) retval;
+	return (gint) (guchar) retval;
 }
 
 gchar *
@@ -284,3 +293,428 @@ free_language_list (GSList *list)
   g_slist_free (list);
 }
 
+void
+cache_plugin_clear (HildonIMCachePlugin *plugin)
+{
+	if (plugin == NULL)
+		return;
+
+	FREE_IF_SET (plugin->filename);
+	free_language_list (plugin->languages);
+	plugin->languages = NULL;
+
+	FREE_IF_SET (plugin->info.description);
+	FREE_IF_SET (plugin->info.name);
+	FREE_IF_SET (plugin->info.menu_title);
+	FREE_IF_SET (plugin->info.gettext_domain);
+	FREE_IF_SET (plugin->info.special_plugin);
+	FREE_IF_SET (plugin->info.ossohelp_id);
+}
+
+void
+cache_plugin_set_stat (HildonIMCachePlugin *plugin, const struct stat *st)
+{
+	plugin->inode = st->st_ino;
+	plugin->size = st->st_size;
+	plugin->mtime = st->st_mtim.tv_sec;
+	plugin->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+gboolean
+cache_plugin_is_current (const HildonIMCachePlugin *plugin,
+                         const struct stat *st)
+{
+	/* Records without a signature never match */
+	return (plugin->inode != 0 &&
+	        plugin->inode == (guint64) st->st_ino &&
+	        plugin->size == (guint64) st->st_size &&
+	        plugin->mtime == (gint64) st->st_mtim.tv_sec &&
+	        plugin->mtime_nsec == (guint32) st->st_mtim.tv_nsec);
+}
+
+/* utimes() only has microsecond precision */
+static gboolean
+cache_same_mtime (const struct stat *a, const struct stat *b)
+{
+	return (a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	        a->st_mtim.tv_nsec / 1000 == b->st_mtim.tv_nsec / 1000);
+}
+
+gboolean
+cache_stamp (void)
+{
+	gchar *filename, *dirname;
+	struct timeval times[2];
+	struct stat st;
+	gboolean retval = FALSE;
+
+	filename = get_cache_file (CACHE_FILENAME);
+	dirname = get_cache_file (CACHE_DIRECTORY);
+
+	if (stat (dirname, &st) == 0)
+	{
+		times[0].tv_sec = st.st_atim.tv_sec;
+		times[0].tv_usec = st.st_atim.tv_nsec / 1000;
+		times[1].tv_sec = st.st_mtim.tv_sec;
+		times[1].tv_usec = st.st_mtim.tv_nsec / 1000;
+
+		retval = (utimes (filename, times) == 0);
+	}
+
+	g_free (dirname);
+	g_free (filename);
+
+	return retval;
+}
+
+gboolean
+cache_is_stale (const HildonIMCache *cache)
+{
+	gchar *filename, *dirname;
+	struct stat file_st, dir_st, st;
+	gboolean stale = TRUE;
+	guint i;
+
+	if (cache == NULL)
+		return TRUE;
+
+	filename = get_cache_file (CACHE_FILENAME);
+	dirname = get_cache_file (CACHE_DIRECTORY);
+
+	/* Anything added to or removed from the directory changes its mtime */
+	if (stat (filename, &file_st) != 0 || stat (dirname, &dir_st) != 0 ||
+	    !cache_same_mtime (&file_st, &dir_st))
+		goto out;
+
+	/* A .so can also be overwritten in place */
+	for (i = 0; i < cache->num_plugins; i ++)
+	{
+		const HildonIMCachePlugin *plugin = &cache->plugins [i];
+
+		if (plugin->inode == 0)
+			continue;
+
+		if (stat (plugin->filename, &st) != 0 ||
+		    !cache_plugin_is_current (plugin, &st))
+			goto out;
+	}
+
+	stale = FALSE;
+
+out:
+	g_free (dirname);
+	g_free (filename);
+
+	return stale;
+}
+
+/* Reads a version 0 cache with the stdio based reader */
+static HildonIMCache *
+cache_open_v0 (void)
+{
+	HildonIMCache *cache;
+	FILE *f;
+	gint i, n;
+
+	f = init_cache ();
+	if (f == NULL)
+		return NULL;
+
+	n = cache_get_number_of_plugins (f);
+	cache = g_new0 (HildonIMCache, 1);
+	cache->version = CACHE_VERSION_0;
+	cache->plugins = g_new0 (HildonIMCachePlugin, MAX (n, 1));
+
+	for (i = 0; i < n; i ++)
+	{
+		HildonIMCachePlugin *plugin = &cache->plugins [cache->num_plugins];
+		HildonIMPluginInfo *info;
+
+		plugin->filename = cache_get_soname (f);
+		plugin->languages = cache_get_languages (f);
+		info = cache_get_iminfo (f);
+		if (info == NULL)
+		{
+			cache_plugin_clear (plugin);
+			break;
+		}
+
+		plugin->info = *info;
+		g_free (info);
+		cache->num_plugins ++;
+	}
+
+	fclose (f);
+	return cache;
+}
+
+#define LE32(v) GUINT32_FROM_LE (v)
+#define LE64(v) GUINT64_FROM_LE (v)
+
+static inline const gchar *
+cache_string (const HildonIMCache *cache, guint32 offset, gboolean *ok)
+{
+	offset = LE32 (offset);
+
+	if (offset >= cache->pool_size)
+	{
+		*ok = FALSE;
+		return NULL;
+	}
+
+	if (offset == 0)
+		return NULL;
+
+	return cache->pool + offset;
+}
+
+static void
+cache_header_from_le (CacheHeader *header)
+{
+	header->num_plugins = LE32 (header->num_plugins);
+	header->records_size = LE32 (header->records_size);
+	header->records_offset = LE32 (header->records_offset);
+	header->languages_offset = LE32 (header->languages_offset);
+	header->num_languages = LE32 (header->num_languages);
+	header->strings_offset = LE32 (header->strings_offset);
+	header->strings_size = LE32 (header->strings_size);
+}
+
+static gboolean
+cache_map_plugins (HildonIMCache *cache)
+{
+	const gchar *base = cache->map;
+	CacheHeader header;
+	const guint32 *languages;
+	gboolean ok = TRUE;
+	gsize offset;
+	guint i;
+
+	memcpy (&header, base, sizeof (CacheHeader));
+	cache_header_from_le (&header);
+
+	if (header.records_offset > cache->map_size ||
+	    header.records_size > cache->map_size - header.records_offset ||
+	    header.num_plugins > header.records_size / CACHE_RECORD_MIN_SIZE ||
+	    header.languages_offset > cache->map_size ||
+	    header.num_languages > (cache->map_size - header.languages_offset) /
+	                           sizeof (guint32) ||
+	    header.strings_offset > cache->map_size ||
+	    header.strings_size > cache->map_size - header.strings_offset ||
+	    header.strings_size == 0 ||
+	    base [header.strings_offset + header.strings_size - 1] != '\0' ||
+	    header.records_offset % sizeof (guint32) != 0 ||
+	    header.languages_offset % sizeof (guint32) != 0)
+	{
+		g_warning ("Corrupted cache file");
+		return FALSE;
+	}
+
+	languages = (const guint32 *) (base + header.languages_offset);
+	cache->pool = base + header.strings_offset;
+	cache->pool_size = header.strings_size;
+
+	cache->plugins = g_new0 (HildonIMCachePlugin, MAX (header.num_plugins, 1));
+	cache->num_plugins = header.num_plugins;
+
+	offset = header.records_offset;
+	for (i = 0; i < header.num_plugins && ok; i ++)
+	{
+		const gchar *mapped = base + offset;
+		HildonIMCachePlugin *plugin = &cache->plugins [i];
+		HildonIMPluginInfo *info = &plugin->info;
+		CacheRecord record;
+		guint32 length, first, count, j;
+
+		if (header.records_offset + header.records_size - offset <
+		    sizeof (guint32))
+		{
+			ok = FALSE;
+			break;
+		}
+
+		memcpy (&length, mapped, sizeof (guint32));
+		length = LE32 (length);
+		if (length < CACHE_RECORD_MIN_SIZE || length % sizeof (guint32) != 0 ||
+		    length > header.records_offset + header.records_size - offset)
+		{
+			ok = FALSE;
+			break;
+		}
+
+		/* Fields this reader knows of but the writer did not store read
+		 * as 0, fields added after them are skipped */
+		memset (&record, 0, sizeof (CacheRecord));
+		memcpy (&record, mapped, MIN (length, sizeof (CacheRecord)));
+		offset += length;
+
+		first = LE32 (record.languages);
+		count = LE32 (record.num_languages);
+		if (first > header.num_languages ||
+		    count > header.num_languages - first)
+		{
+			ok = FALSE;
+			break;
+		}
+
+		/* The mapping is read-only, the strings are never written to */
+		plugin->filename = (gchar *) cache_string (cache, record.filename, &ok);
+		for (j = count; j > 0; j --)
+		{
+			const gchar *lang;
+
+			lang = cache_string (cache, languages [first + j - 1], &ok);
+			if (lang != NULL)
+				plugin->languages = g_slist_prepend (plugin->languages,
+				                                     (gchar *) lang);
+		}
+
+		/* The rest is left to cache_plugin_get_info() */
+		info->name = (gchar *) cache_string (cache, record.name, &ok);
+		info->special_plugin = (gchar *) cache_string (cache,
+			record.special_plugin, &ok);
+		plugin->record = mapped;
+
+		info->visible_in_menu = (record.visible_in_menu != 0);
+		info->cached = (record.cached != 0);
+		info->disable_common_buttons = (record.disable_common_buttons != 0);
+		info->type = (gint32) LE32 (record.type);
+		info->group = (gint32) LE32 (record.group);
+		info->priority = (gint32) LE32 (record.priority);
+		info->height = (gint32) LE32 (record.height);
+		info->trigger = (gint32) LE32 (record.trigger);
+
+		if (length >= sizeof (CacheRecord))
+		{
+			plugin->mtime_nsec = LE32 (record.mtime_nsec);
+			plugin->inode = LE64 (record.inode);
+			plugin->size = LE64 (record.size);
+			plugin->mtime = (gint64) LE64 (record.mtime);
+		}
+	}
+
+	if (!ok)
+		g_warning ("Corrupted plugin record in cache file");
+
+	return ok;
+}
+
+const HildonIMPluginInfo *
+cache_plugin_get_info (HildonIMCache *cache, HildonIMCachePlugin *plugin)
+{
+	HildonIMPluginInfo *info = &plugin->info;
+	CacheRecord record;
+	gboolean ok = TRUE;
+
+	if (plugin->record == NULL)
+		return info;
+
+	/* Records are only 32 bit aligned in the mapping, so they are copied
+	 * out before use. These fields are all within CACHE_RECORD_MIN_SIZE,
+	 * which every record was checked to have */
+	memcpy (&record, plugin->record, CACHE_RECORD_MIN_SIZE);
+
+	info->description = (gchar *) cache_string (cache,
+		record.description, &ok);
+	info->menu_title = (gchar *) cache_string (cache,
+		record.menu_title, &ok);
+	info->gettext_domain = (gchar *) cache_string (cache,
+		record.gettext_domain, &ok);
+	info->ossohelp_id = (gchar *) cache_string (cache,
+		record.ossohelp_id, &ok);
+
+	if (!ok)
+		g_warning ("Corrupted plugin record in cache file");
+
+	plugin->record = NULL;
+
+	return info;
+}
+
+HildonIMCache *
+cache_open (void)
+{
+	HildonIMCache *cache;
+	gchar *filename;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	filename = get_cache_file (CACHE_FILENAME);
+	if (filename == NULL)
+		return NULL;
+
+	fd = open (filename, O_RDONLY);
+	if (fd < 0)
+	{
+		g_warning ("Couldn't open %s for reading. Forgot "
+		           "to run hildon-im-recache?", filename);
+		g_free (filename);
+		return NULL;
+	}
+
+	if (fstat (fd, &st) != 0 || st.st_size < sizeof (CacheHeader))
+	{
+		close (fd);
+		g_free (filename);
+		return cache_open_v0 ();
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+	{
+		g_warning ("Unable to map %s", filename);
+		g_free (filename);
+		return cache_open_v0 ();
+	}
+
+	if (memcmp (((CacheHeader *) map)->signature, CACHE_SIGNATURE,
+	            SIG_LENGTH) != 0 ||
+	    ((CacheHeader *) map)->version != CACHE_VERSION)
+	{
+		/* Most likely a cache written by an older hildon-im-recache */
+		munmap (map, st.st_size);
+		g_free (filename);
+		return cache_open_v0 ();
+	}
+
+	g_free (filename);
+
+	cache = g_new0 (HildonIMCache, 1);
+	cache->version = CACHE_VERSION;
+	cache->map = map;
+	cache->map_size = st.st_size;
+
+	if (!cache_map_plugins (cache))
+	{
+		cache_close (cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void
+cache_close (HildonIMCache *cache)
+{
+	guint i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->num_plugins; i ++)
+	{
+		if (cache->map != NULL)
+			g_slist_free (cache->plugins [i].languages);
+		else
+			cache_plugin_clear (&cache->plugins [i]);
+	}
+
+	g_free (cache->plugins);
+
+	if (cache->map != NULL)
+		munmap (cache->map, cache->map_size);
+
+	g_free (cache);
+}
@@ -26,19 +26,63 @@
 
 #include <glib.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include "hildon-im-plugin.h"
 
 /**
  * hildon-input-method cache file
  * 
 <programlisting>
-Cache file format:
+Cache file format, version 2:
 
 Offset  Size  Description
 0       3     'HIM'   Signature
-4       1     0       Version
-5       1     Number of plugins
-6       ~     the plugins
+3       1     2       Version
+4       4     Number of plugins
+8       4     Size of the record area in bytes
+12      4     Offset of the record area
+16      4     Offset of the language table
+20      4     Number of entries in the language table
+24      4     Offset of the string pool
+28      4     Size of the string pool
+
+Record area (one #CacheRecord per plugin, back to back):
+0       4     Length of this record in bytes, a multiple of 4
+4       4     String: filename
+8       4     Index of the first language in the language table
+12      4     Number of languages
+16      ~     HildonIMPluginInfo, strings as String, enums as integer
+64      4     Nanoseconds of the modification time of the .so file
+68      4     Reserved
+72      8     Inode of the .so file
+80      8     Size of the .so file
+88      8     Modification time of the .so file
+
+Language table:
+0       4     String: language code, repeated
+
+String:
+0       4     Offset of the NUL terminated string inside the string pool
+
+All integers are little-endian. The string pool starts with a NUL byte
+so offset 0 stands for NULL. The file is mapped with mmap() and the
+strings are used in place.
+
+A reader uses the fields it knows of each record and skips to the next
+one with the record length, so fields can be appended without breaking
+older readers. Records shorter than 64 bytes are invalid, records
+shorter than 96 bytes do not carry the stat signature of the .so file.
+
+Version 1 files (host byte order, fixed-size records without a length)
+are not read anymore; they are reported as stale and rebuilt.
+
+Cache file format, version 0 (read only as a fallback):
+
+Offset  Size  Description
+0       3     'HIM'   Signature
+3       1     0       Version
+4       1     Number of plugins
+5       ~     the plugins
 
 0       ~     String: filename
 
@@ -61,10 +105,114 @@ Enums values are stored as integer.
 */
 
 #define CACHE_SIGNATURE   "HIM"
-#define CACHE_VERSION     0
+#define CACHE_VERSION     2
+#define CACHE_VERSION_0   0
 #define CACHE_FILE        "hildon-im-plugins.cache"
 #define CACHE_START_OFFSET 4
 
+typedef struct
+{
+  gchar   signature [3];
+  guint8  version;
+  guint32 num_plugins;
+  guint32 records_size;
+  guint32 records_offset;
+  guint32 languages_offset;
+  guint32 num_languages;
+  guint32 strings_offset;
+  guint32 strings_size;
+} CacheHeader;
+
+typedef struct
+{
+  guint32 length;
+
+  guint32 filename;
+  guint32 languages;
+  guint32 num_languages;
+
+  guint32 description;
+  guint32 name;
+  guint32 menu_title;
+  guint32 gettext_domain;
+  guint32 special_plugin;
+  guint32 ossohelp_id;
+
+  gint32  type;
+  gint32  group;
+  gint32  priority;
+  gint32  height;
+  gint32  trigger;
+
+  guint8  visible_in_menu;
+  guint8  cached;
+  guint8  disable_common_buttons;
+  guint8  reserved;
+
+  guint32 mtime_nsec;
+  guint32 reserved2;
+  guint64 inode;
+  guint64 size;
+  gint64  mtime;
+} CacheRecord;
+
+#define CACHE_RECORD_MIN_SIZE G_STRUCT_OFFSET (CacheRecord, mtime_nsec)
+
+/**
+ * HildonIMCachePlugin:
+ * @filename: the .so file of the plugin
+ * @languages: list of the language codes supported by the plugin
+ * @info: the #HildonIMPluginInfo of the plugin
+ * @inode: inode of @filename when it was cached
+ * @size: size of @filename when it was cached
+ * @mtime: modification time of @filename when it was cached
+ * @mtime_nsec: nanosecond part of @mtime
+ *
+ * One plugin as stored in the cache. When the cache is mapped, the
+ * strings point into the mapping and only live as long as the cache.
+ *
+ * Only the fields needed to pick a plugin are decoded when the cache is
+ * opened: @filename, @languages and the name, special_plugin and numeric
+ * fields of @info. The description, menu_title, gettext_domain and
+ * ossohelp_id of @info stay %NULL until cache_plugin_get_info() is
+ * called.
+ */
+typedef struct
+{
+  gchar              *filename;
+  GSList             *languages;
+  HildonIMPluginInfo  info;
+
+  guint64             inode;
+  guint64             size;
+  gint64              mtime;
+  guint32             mtime_nsec;
+
+  /*< private >*/
+  gconstpointer       record;
+} HildonIMCachePlugin;
+
+/**
+ * HildonIMCache:
+ * @version: the version of the file the plugins were read from
+ * @num_plugins: number of entries in @plugins
+ * @plugins: the plugins
+ *
+ * A loaded plugin cache.
+ */
+typedef struct
+{
+  gint                 version;
+  guint                num_plugins;
+  HildonIMCachePlugin *plugins;
+
+  /*< private >*/
+  gpointer             map;
+  gsize                map_size;
+  const gchar         *pool;
+  gsize                pool_size;
+} HildonIMCache;
+
 enum {
   CACHE_FILENAME,
   CACHE_FILENAME_TMP,
@@ -114,7 +262,7 @@ GSList *cache_get_languages (FILE *f);
 /**
  * init_cache:
  * 
- * Gets the cache file.
+ * Opens a version 0 cache file and checks its header.
  * 
  * Returns: the cache file.
  */
@@ -145,4 +293,88 @@ gchar *cache_get_soname (FILE *f);
  * Frees a #HildonIMPluginInfo.
  */
 void free_iminfo (HildonIMPluginInfo *info);
+
+/**
+ * cache_open:
+ * 
+ * Loads the cache file. Version 2 files are mapped into memory, version 0
+ * files are read as a fallback.
+ * 
+ * Returns: a newly allocated #HildonIMCache, or %NULL if the cache could
+ * not be read. Free it with cache_close().
+ */
+HildonIMCache *cache_open (void);
+
+/**
+ * cache_close:
+ * @cache: a #HildonIMCache
+ * 
+ * Unmaps and frees the cache. Pointers taken from it are invalid afterwards.
+ */
+void cache_close (HildonIMCache *cache);
+
+/**
+ * cache_plugin_clear:
+ * @plugin: a #HildonIMCachePlugin with its own copies of the strings
+ * 
+ * Frees the strings and the language list held by @plugin.
+ */
+void cache_plugin_clear (HildonIMCachePlugin *plugin);
+
+/**
+ * cache_plugin_get_info:
+ * @cache: the #HildonIMCache @plugin belongs to
+ * @plugin: a #HildonIMCachePlugin
+ * 
+ * Decodes the remaining strings of the plugin info on first use.
+ * 
+ * Returns: the complete #HildonIMPluginInfo of @plugin.
+ */
+const HildonIMPluginInfo *cache_plugin_get_info (HildonIMCache *cache,
+                                                 HildonIMCachePlugin *plugin);
+
+/**
+ * cache_plugin_set_stat:
+ * @plugin: a #HildonIMCachePlugin
+ * @st: the stat of the plugin's .so file
+ * 
+ * Stores the inode, size and modification time of @st in @plugin.
+ */
+void cache_plugin_set_stat (HildonIMCachePlugin *plugin,
+                            const struct stat *st);
+
+/**
+ * cache_plugin_is_current:
+ * @plugin: a #HildonIMCachePlugin
+ * @st: the stat of the plugin's .so file
+ * 
+ * Checks whether the .so file is still the one that was cached.
+ * 
+ * Returns: %TRUE if inode, size and modification time all match.
+ */
+gboolean cache_plugin_is_current (const HildonIMCachePlugin *plugin,
+                                  const struct stat *st);
+
+/**
+ * cache_stamp:
+ * 
+ * Copies the modification time of the plugin directory to the cache
+ * file. Called by hildon-im-recache once the new cache is in place.
+ * 
+ * Returns: %TRUE on success.
+ */
+gboolean cache_stamp (void);
+
+/**
+ * cache_is_stale:
+ * @cache: a #HildonIMCache or %NULL
+ * 
+ * Cheap freshness check that does not load any plugin. The cache is
+ * stale if the plugin directory was modified after the cache was
+ * stamped, or if a cached .so no longer matches its stat signature.
+ * 
+ * Returns: %TRUE if hildon-im-recache should be run again.
+ */
+gboolean cache_is_stale (const HildonIMCache *cache);
+
 #endif
@@ -26,6 +26,8 @@
 #include <glib/gthread.h>
 #include "hildon-im-ui.h"
 #include "internal.h"
+#include "profile.h"
+#include "metrics.h"
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -53,9 +55,66 @@
 #define DBUS_SIGNAL_SET_VISIBLE "set_visible"
 #define DBUS_MATCH_RULE "type='signal',interface='" DBUS_IFACE_HIM "',member='" DBUS_SIGNAL_SET_VISIBLE "'"
 
+#define DBUS_PATH_HIM "/org/maemo/him"
+#define DBUS_METHOD_GET_METRICS "GetMetrics"
+#define DBUS_METHOD_RESET_METRICS "ResetMetrics"
+#define DBUS_IFACE_INTROSPECTABLE "org.freedesktop.DBus.Introspectable"
+
+static const char introspection_xml[] =
+  "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+  " \"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+  "<node>\n"
+  "  <interface name=\"" DBUS_IFACE_INTROSPECTABLE "\">\n"
+  "    <method name=\"Introspect\">\n"
+  "      <arg name=\"data\" direction=\"out\" type=\"s\"/>\n"
+  "    </method>\n"
+  "  </interface>\n"
+  "  <interface name=\"" DBUS_IFACE_HIM "\">\n"
+  "    <method name=\"" DBUS_METHOD_GET_METRICS "\">\n"
+  "      <arg name=\"counters\" direction=\"out\" type=\"a{st}\"/>\n"
+  "      <arg name=\"histograms\" direction=\"out\" type=\"a{sat}\"/>\n"
+  "    </method>\n"
+  "    <method name=\"" DBUS_METHOD_RESET_METRICS "\"/>\n"
+  "    <signal name=\"" DBUS_SIGNAL_SET_VISIBLE "\">\n"
+  "      <arg name=\"visible\" type=\"b\"/>\n"
+  "    </signal>\n"
+  "  </interface>\n"
+  "</node>\n";
+
 
 GtkWidget *keyboard = NULL;
 
+/* Takes --profile[=json] out of the arguments, before GTK sees them */
+static ProfileFormat
+parse_profile_flag(int *argc, char **argv)
+{
+  ProfileFormat format = profile_parse_format (g_getenv (PROFILE_ENV));
+  int i, j;
+
+  for (i = 1, j = 1; i < *argc; i++)
+  {
+    if (strcmp (argv[i], "--profile") == 0)
+      format = PROFILE_TABLE;
+    else if (g_str_has_prefix (argv[i], "--profile="))
+      format = profile_parse_format (argv[i] + strlen ("--profile="));
+    else
+      argv[j++] = argv[i];
+  }
+  argv[j] = NULL;
+  *argc = j;
+
+  return format;
+}
+
+static gboolean
+first_iteration(gpointer data)
+{
+  profile_mark ("first_main_iteration");
+  profile_dump ();
+
+  return FALSE;
+}
+
 static void
 handle_sigterm(gint t)
 {
@@ -125,6 +184,41 @@ dbus_msg_handler (DBusConnection *connection,
       return DBUS_HANDLER_RESULT_HANDLED;
     }
   }
+  else if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+           g_strcmp0(dbus_message_get_path(msg), DBUS_PATH_HIM) == 0)
+  {
+    DBusMessage *reply = NULL;
+
+    if (strcmp(interface, DBUS_IFACE_HIM) == 0 &&
+        strcmp(method, DBUS_METHOD_GET_METRICS) == 0)
+    {
+      reply = dbus_message_new_method_return(msg);
+      metrics_append(reply);
+    }
+    else if (strcmp(interface, DBUS_IFACE_HIM) == 0 &&
+             strcmp(method, DBUS_METHOD_RESET_METRICS) == 0)
+    {
+      metrics_reset();
+      reply = dbus_message_new_method_return(msg);
+    }
+    else if (strcmp(interface, DBUS_IFACE_INTROSPECTABLE) == 0 &&
+             strcmp(method, "Introspect") == 0)
+    {
+      const char *xml = introspection_xml;
+
+      reply = dbus_message_new_method_return(msg);
+      dbus_message_append_args(reply,
+                               DBUS_TYPE_STRING, &xml,
+                               DBUS_TYPE_INVALID);
+    }
+
+    if (reply != NULL)
+    {
+      dbus_connection_send(connection, reply, NULL);
+      dbus_message_unref(reply);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+  }
   
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
@@ -224,14 +318,19 @@ main(int argc, char *argv[])
   struct sigaction sv;
   DBusConnection *dbus_connection;
   DBusConnection *dbus_connection_system;
+
+  profile_init (parse_profile_flag (&argc, argv));
+  profile_mark ("main");
 #if !GLIB_CHECK_VERSION(2,32,0)
   if (!g_thread_supported ()) g_thread_init (NULL);
 #endif
   hildon_gtk_init(&argc, &argv);
+  profile_mark ("hildon_gtk_init");
   /* TODO call hildon_init() here
    * or replace both calls with hildon_gtk_init() */
 
   gconf_init(argc, argv, NULL);
+  profile_mark ("gconf_init");
 
   setlocale (LC_ALL, "");
   bindtextdomain (PACKAGE, LOCALEDIR);
@@ -244,7 +343,9 @@ main(int argc, char *argv[])
   g_signal_connect(keyboard, "destroy", gtk_main_quit, NULL);
 
   dbus_connection_system = register_on_system_dbus();
+  profile_mark ("register_on_system_dbus");
   dbus_connection = register_on_session_dbus();
+  profile_mark ("register_on_session_dbus");
   (void)dbus_connection;
   (void)dbus_connection_system;
 
@@ -257,6 +358,9 @@ main(int argc, char *argv[])
   /* ignore SIGHUP */
   signal(SIGHUP, SIG_IGN);
 
+  if (profile_enabled ())
+    g_idle_add (first_iteration, NULL);
+
   gtk_main();
 
   return 0;
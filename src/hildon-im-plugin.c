@@ -29,9 +29,26 @@
 
 #include <string.h>
 
+#include "config.h"
 #include "hildon-im-plugin.h"
+#include "internal.h"
+#include "metrics.h"
+#include "probes.h"
+
+/* Seconds a module stays loaded after its last instance is gone */
+#define DEFAULT_UNLOAD_DELAY 60
+
+/* Calls a method of the plugin interface between the plugin_dispatch
+ * probes, args being the parenthesized argument list */
+#define PLUGIN_DISPATCH(plugin, iface, method, args) \
+  G_STMT_START { \
+    HIM_PROBE2(plugin_dispatch__entry, G_OBJECT_TYPE_NAME(plugin), #method); \
+    (iface)->method args; \
+    HIM_PROBE2(plugin_dispatch__return, G_OBJECT_TYPE_NAME(plugin), #method); \
+  } G_STMT_END
 
 static GSList *loaded_modules = NULL;
+static guint unload_delay = DEFAULT_UNLOAD_DELAY;
 
 typedef struct _HildonIMPluginModule            HildonIMPluginModule;
 typedef struct _HildonIMPluginModuleClass       HildonIMPluginModuleClass;
@@ -48,6 +65,12 @@ struct _HildonIMPluginModule
 
   /*if any member needs mem alloc, finalized is used to clean it*/
   gchar *path; /*where the share object is*/
+
+  guint instances;    /* live plugins created by the module */
+  gboolean held;      /* we hold a use until the module goes idle */
+  guint unload_id;
+
+  GSList *waiters;    /* HildonIMPluginWaiter, while opened on a worker */
 };
 
 struct _HildonIMPluginModuleClass
@@ -69,6 +92,30 @@ static void     hildon_im_plugin_module_unload          (GTypeModule *module);
 
 static void     hildon_im_plugin_module_finalize        (GObject *object);
 
+/* In the order of the module_init, module_exit and module_create members */
+static const gchar *module_symbols[] =
+{
+  "module_init",
+  "module_exit",
+  "module_create"
+};
+
+/* A module opened on a worker thread, handed back to the main thread */
+typedef struct
+{
+  HildonIMPluginModule *module;
+  GModule *library;
+  gpointer symbols[G_N_ELEMENTS (module_symbols)];
+  gchar *error;
+} HildonIMPluginLoad;
+
+typedef struct
+{
+  HildonIMUI *keyboard;
+  HildonIMPluginCreateFunc callback;
+  gpointer user_data;
+} HildonIMPluginWaiter;
+
 static void
 hildon_im_plugin_module_class_init(HildonIMPluginModuleClass *class)
 {
@@ -87,45 +134,84 @@ hildon_im_plugin_module_init(HildonIMPluginModule *module)
   /* empty */
 }
 
-/*we come to this function from by g_type_module_use
- *purpose of this function is to find the strings in the
- *shared object to link the functions*/
-
-static gboolean
-hildon_im_plugin_module_load(GTypeModule *module)
+/*opens the shared object and finds the strings in it to link the
+ *functions. Touches no module state, so it can run on any thread*/
+static GModule *
+hildon_im_plugin_module_open(const gchar *path, gpointer *symbols,
+                             gchar **error)
 {
-  HildonIMPluginModule *himp_module = HILDON_IM_PLUGIN_MODULE(module);
-
-  if (himp_module->path == NULL)
-  {
-    return FALSE;
-  }
+  GModule *library;
+  guint i;
 
-  himp_module->library = g_module_open(himp_module->path, 0);
+  library = g_module_open(path, 0);
 
-  if (!himp_module->library)
+  if (!library)
   {
-    g_warning("%s", g_module_error());
-    return FALSE;
+    *error = g_strdup(g_module_error());
+    return NULL;
   }
 
   /*module_init -> register the type
    *module_exit -> clean up the mess(done in init)
    *module_create -> create instance (g_type_new)*/
-  if (!g_module_symbol(himp_module->library, "module_init",
-                       (gpointer *)&himp_module->init) ||
-      !g_module_symbol(himp_module->library, "module_exit",
-                       (gpointer *)&himp_module->exit) ||
-      !g_module_symbol(himp_module->library, "module_create",
-                       (gpointer *)&himp_module->create))
+  for (i = 0; i < G_N_ELEMENTS(module_symbols); i++)
   {
-    g_warning("%s", g_module_error());
-    g_module_close (himp_module->library);
+    if (!g_module_symbol(library, module_symbols[i], &symbols[i]))
+    {
+      *error = g_strdup(g_module_error());
+      g_module_close(library);
 
-    return FALSE;
+      return NULL;
+    }
+  }
+
+  return library;
+}
+
+static void
+hildon_im_plugin_module_set_library(HildonIMPluginModule *himp_module,
+                                    GModule *library, gpointer *symbols)
+{
+  himp_module->library = library;
+  himp_module->init = symbols[0];
+  himp_module->exit = symbols[1];
+  himp_module->create = symbols[2];
+}
+
+/*we come to this function from by g_type_module_use
+ *purpose of this function is to link the functions of the shared
+ *object, unless a worker already did, and to register the types*/
+
+static gboolean
+hildon_im_plugin_module_load(GTypeModule *module)
+{
+  HildonIMPluginModule *himp_module = HILDON_IM_PLUGIN_MODULE(module);
+
+  if (himp_module->library == NULL)
+  {
+    gpointer symbols[G_N_ELEMENTS(module_symbols)];
+    GModule *library;
+    gchar *error = NULL;
+
+    if (himp_module->path == NULL)
+    {
+      return FALSE;
+    }
+
+    library = hildon_im_plugin_module_open(himp_module->path, symbols,
+                                           &error);
+    if (!library)
+    {
+      g_warning("%s", error);
+      g_free(error);
+      return FALSE;
+    }
+
+    hildon_im_plugin_module_set_library(himp_module, library, symbols);
   }
 
   himp_module->init (module);
+  metrics_count_keyed ("module_loads", module->name, 1);
 
   return TRUE;
 }
@@ -145,6 +231,7 @@ hildon_im_plugin_module_unload(GTypeModule *module)
   himp_module->init = NULL;
   himp_module->exit = NULL;
   himp_module->create = NULL;
+  metrics_count_keyed ("module_unloads", module->name, 1);
 }
 
 static void
@@ -160,6 +247,54 @@ hildon_im_plugin_module_finalize(GObject *object)
   G_OBJECT_CLASS(hildon_im_plugin_module_parent_class)->finalize(object);
 }
 
+/* Drops the use held since the module had live instances, which closes
+ * the library unless the type system still references its classes */
+static void
+hildon_im_plugin_module_release(HildonIMPluginModule *himp_module)
+{
+  if (himp_module->unload_id != 0)
+  {
+    g_source_remove(himp_module->unload_id);
+    himp_module->unload_id = 0;
+  }
+
+  if (himp_module->held && himp_module->instances == 0)
+  {
+    himp_module->held = FALSE;
+    g_type_module_unuse(G_TYPE_MODULE(himp_module));
+  }
+}
+
+static gboolean
+hildon_im_plugin_module_unload_timeout(gpointer data)
+{
+  HildonIMPluginModule *himp_module = data;
+
+  himp_module->unload_id = 0;
+  hildon_im_plugin_module_release(himp_module);
+
+  return FALSE;
+}
+
+static void
+hildon_im_plugin_module_instance_gone(gpointer data, GObject *plugin)
+{
+  HildonIMPluginModule *himp_module = data;
+
+  metrics_count(METRICS_PLUGIN_DESTROYS, 1);
+
+  if (--himp_module->instances > 0)
+    return;
+
+  if (unload_delay == 0)
+    hildon_im_plugin_module_release(himp_module);
+  else if (himp_module->unload_id == 0)
+    himp_module->unload_id =
+      g_timeout_add_seconds(unload_delay,
+                            hildon_im_plugin_module_unload_timeout,
+                            himp_module);
+}
+
 static HildonIMPlugin *
 hildon_im_plugin_module_create(HildonIMUI *keyboard,
                                HildonIMPluginModule *himp_module)
@@ -171,7 +306,28 @@ hildon_im_plugin_module_create(HildonIMUI *keyboard,
   if (g_type_module_use(G_TYPE_MODULE(himp_module)))
   {
     plugin = himp_module->create(keyboard);
-    g_type_module_unuse(G_TYPE_MODULE(himp_module));
+
+    if (plugin == NULL || himp_module->held)
+    {
+      g_type_module_unuse(G_TYPE_MODULE(himp_module));
+    }
+    else
+    {
+      himp_module->held = TRUE;
+    }
+
+    if (plugin != NULL)
+    {
+      if (himp_module->unload_id != 0)
+      {
+        g_source_remove(himp_module->unload_id);
+        himp_module->unload_id = 0;
+      }
+      himp_module->instances++;
+      metrics_count(METRICS_PLUGIN_CREATES, 1);
+      g_object_weak_ref(G_OBJECT(plugin),
+                        hildon_im_plugin_module_instance_gone, himp_module);
+    }
     return plugin;
   }
   return NULL;
@@ -200,38 +356,219 @@ hildon_im_plugin_get_type(void)
   return type;
 }
 
-/*public function to create plugin
- * string passed for opening the shared object*/
-HildonIMPlugin *
-hildon_im_plugin_create(HildonIMUI *keyboard,
-                        const gchar *plugin_name)
+/*finds the module of a plugin, or makes a new one for it*/
+static HildonIMPluginModule *
+hildon_im_plugin_module_lookup(const gchar *plugin_name)
 {
   GSList *i = NULL;
   HildonIMPluginModule *module = NULL;
-  HildonIMPlugin *plugin = NULL;
 
   for (i = loaded_modules; i != NULL; i = i->next)
   {
     module = i->data;
     if (strcmp(G_TYPE_MODULE(module)->name, plugin_name) == 0)
     {
-      return hildon_im_plugin_module_create(keyboard, module);
+      return module;
     }
   }
 
-  plugin = NULL;
-  if (g_module_supported())
+  if (!g_module_supported())
+  {
+    return NULL;
+  }
+
+  module = g_object_new(HILDON_IM_TYPE_PLUGIN_MODULE, NULL);
+  g_type_module_set_name(G_TYPE_MODULE(module), plugin_name);
+  module->path = g_strdup(plugin_name);
+  loaded_modules = g_slist_prepend(loaded_modules, (void *) module);
+
+  return module;
+}
+
+/*public function to create plugin
+ * string passed for opening the shared object*/
+HildonIMPlugin *
+hildon_im_plugin_create(HildonIMUI *keyboard,
+                        const gchar *plugin_name)
+{
+  HildonIMPluginModule *module;
+  HildonIMPlugin *plugin = NULL;
+
+  HIM_PROBE1(plugin_create__entry, plugin_name);
+
+  module = hildon_im_plugin_module_lookup(plugin_name);
+  if (module != NULL)
   {
-    module = g_object_new(HILDON_IM_TYPE_PLUGIN_MODULE, NULL);
-    g_type_module_set_name(G_TYPE_MODULE(module), plugin_name);
-    module->path = g_strdup(plugin_name);
-    loaded_modules = g_slist_prepend(loaded_modules, (void *) module);
     plugin = hildon_im_plugin_module_create(keyboard, module);
   }
 
+  HIM_PROBE2(plugin_create__return, plugin_name, plugin);
+
   return plugin;
 }
 
+/*main thread half of hildon_im_plugin_create_async: registers the types
+ *of the opened module and creates the plugins that were waiting for it*/
+static gboolean
+hildon_im_plugin_load_done(gpointer data)
+{
+  HildonIMPluginLoad *load = data;
+  HildonIMPluginModule *module = load->module;
+  GSList *waiters, *i;
+
+  if (load->library == NULL)
+  {
+    g_warning("%s", load->error);
+  }
+  else if (module->library == NULL)
+  {
+    hildon_im_plugin_module_set_library(module, load->library,
+                                        load->symbols);
+  }
+  else
+  {
+    /* Loaded synchronously in the meantime */
+    g_module_close(load->library);
+  }
+
+  waiters = module->waiters;
+  module->waiters = NULL;
+
+  for (i = waiters; i != NULL; i = i->next)
+  {
+    HildonIMPluginWaiter *waiter = i->data;
+    HildonIMPlugin *plugin = NULL;
+
+    if (load->library != NULL)
+    {
+      plugin = hildon_im_plugin_module_create(waiter->keyboard, module);
+    }
+    waiter->callback(plugin, waiter->user_data);
+
+    g_object_unref(waiter->keyboard);
+    g_free(waiter);
+  }
+  g_slist_free(waiters);
+
+  g_free(load->error);
+  g_free(load);
+
+  return FALSE;
+}
+
+static gpointer
+hildon_im_plugin_load_thread(gpointer data)
+{
+  HildonIMPluginLoad *load = data;
+
+  load->library = hildon_im_plugin_module_open(load->module->path,
+                                               load->symbols, &load->error);
+  g_idle_add(hildon_im_plugin_load_done, load);
+
+  return NULL;
+}
+
+static gboolean
+hildon_im_plugin_threads_supported(void)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+  return TRUE;
+#else
+  return g_thread_supported();
+#endif
+}
+
+/*starts a detached hildon_im_plugin_load_thread()*/
+static gboolean
+hildon_im_plugin_spawn_load(HildonIMPluginLoad *load, GError **error)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+  GThread *thread;
+
+  thread = g_thread_try_new("hildon-im-plugin-load",
+                            hildon_im_plugin_load_thread, load, error);
+  if (thread == NULL)
+  {
+    return FALSE;
+  }
+  g_thread_unref(thread);
+  return TRUE;
+#else
+  return g_thread_create(hildon_im_plugin_load_thread, load,
+                         FALSE, error) != NULL;
+#endif
+}
+
+void
+hildon_im_plugin_create_async(HildonIMUI *keyboard,
+                              const gchar *plugin_name,
+                              HildonIMPluginCreateFunc callback,
+                              gpointer user_data)
+{
+  HildonIMPluginModule *module;
+  HildonIMPluginWaiter *waiter;
+  HildonIMPluginLoad *load;
+  GError *error = NULL;
+
+  g_return_if_fail(HILDON_IM_IS_UI(keyboard));
+  g_return_if_fail(callback != NULL);
+
+  module = hildon_im_plugin_module_lookup(plugin_name);
+  if (module == NULL)
+  {
+    callback(NULL, user_data);
+    return;
+  }
+
+  /* Nothing to page in, or no thread to do it on */
+  if (module->waiters == NULL &&
+      (module->library != NULL || !hildon_im_plugin_threads_supported()))
+  {
+    callback(hildon_im_plugin_module_create(keyboard, module), user_data);
+    return;
+  }
+
+  waiter = g_new0(HildonIMPluginWaiter, 1);
+  waiter->keyboard = g_object_ref(keyboard);
+  waiter->callback = callback;
+  waiter->user_data = user_data;
+
+  if (module->waiters != NULL)
+  {
+    module->waiters = g_slist_append(module->waiters, waiter);
+    return;
+  }
+  module->waiters = g_slist_append(NULL, waiter);
+
+  load = g_new0(HildonIMPluginLoad, 1);
+  load->module = module;
+
+  if (!hildon_im_plugin_spawn_load(load, &error))
+  {
+    g_warning("%s", error->message);
+    g_error_free(error);
+
+    hildon_im_plugin_load_thread(load);
+  }
+}
+
+void
+hildon_im_plugin_set_unload_delay(guint seconds)
+{
+  unload_delay = seconds;
+}
+
+void
+hildon_im_plugin_unload_idle_modules(void)
+{
+  GSList *i;
+
+  for (i = loaded_modules; i != NULL; i = i->next)
+  {
+    hildon_im_plugin_module_release(i->data);
+  }
+}
+
 void
 hildon_im_plugin_enable(HildonIMPlugin *plugin, gboolean init)
 {
@@ -247,9 +584,7 @@ hildon_im_plugin_enable(HildonIMPlugin *plugin, gboolean init)
   }
 
   if (iface->enable)
-  {
-    iface->enable(plugin, init);
-  }
+    PLUGIN_DISPATCH(plugin, iface, enable, (plugin, init));
 }
 
 void
@@ -267,9 +602,7 @@ hildon_im_plugin_disable(HildonIMPlugin *plugin)
   }
 
   if (iface->disable)
-  {
-    iface->disable(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, disable, (plugin));
 }
 
 void
@@ -289,9 +622,7 @@ hildon_im_plugin_settings_changed(HildonIMPlugin *plugin,
   }
 
   if (iface->settings_changed)
-  {
-    iface->settings_changed(plugin, key, value);
-  }
+    PLUGIN_DISPATCH(plugin, iface, settings_changed, (plugin, key, value));
 }
 
 void
@@ -310,9 +641,7 @@ hildon_im_plugin_language_settings_changed(HildonIMPlugin *plugin,
   }
 
   if (iface->language_settings_changed)
-  {
-    iface->language_settings_changed(plugin, index);
-  }
+    PLUGIN_DISPATCH(plugin, iface, language_settings_changed, (plugin, index));
 }
 
 void
@@ -330,9 +659,7 @@ hildon_im_plugin_input_mode_changed(HildonIMPlugin *plugin)
   }
 
   if (iface->input_mode_changed)
-  {
-    iface->input_mode_changed(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, input_mode_changed, (plugin));
 }
 
 void
@@ -350,9 +677,7 @@ hildon_im_plugin_keyboard_state_changed(HildonIMPlugin *plugin)
   }
 
   if (iface->keyboard_state_changed)
-  {
-    iface->keyboard_state_changed(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, keyboard_state_changed, (plugin));
 }
 
 void
@@ -370,9 +695,7 @@ hildon_im_plugin_character_autocase(HildonIMPlugin *plugin)
   }
 
   if (iface->character_autocase)
-  {
-    iface->character_autocase(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, character_autocase, (plugin));
 }
 
 void
@@ -390,9 +713,7 @@ hildon_im_plugin_client_widget_changed(HildonIMPlugin *plugin)
   }
 
   if (iface->client_widget_changed)
-  {
-    iface->client_widget_changed(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, client_widget_changed, (plugin));
 }
 
 
@@ -411,9 +732,7 @@ hildon_im_plugin_save_data(HildonIMPlugin *plugin)
   }
 
   if (iface->save_data)
-  {
-    iface->save_data(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, save_data, (plugin));
 }
 
 void
@@ -431,9 +750,7 @@ hildon_im_plugin_clear(HildonIMPlugin *plugin)
   }
 
   if (iface->clear)
-  {
-    iface->clear(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, clear, (plugin));
 }
 
 void hildon_im_plugin_button_activated(HildonIMPlugin *plugin,
@@ -452,9 +769,7 @@ void hildon_im_plugin_button_activated(HildonIMPlugin *plugin,
   }
 
   if (iface->button_activated)
-  {
-    iface->button_activated(plugin, button, long_press);
-  }
+    PLUGIN_DISPATCH(plugin, iface, button_activated, (plugin, button, long_press));
 }
 
 void
@@ -472,9 +787,7 @@ hildon_im_plugin_mode_a(HildonIMPlugin *plugin)
   }
 
   if (iface->mode_a)
-  {
-    iface->mode_a(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, mode_a, (plugin));
 }
 
 void
@@ -492,9 +805,7 @@ hildon_im_plugin_mode_b(HildonIMPlugin *plugin)
   }
 
   if (iface->mode_b)
-  {
-    iface->mode_b(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, mode_b, (plugin));
 }
 
 void
@@ -512,9 +823,7 @@ hildon_im_plugin_language(HildonIMPlugin *plugin)
   }
 
   if (iface->language)
-  {
-    iface->language(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, language, (plugin));
 }
 
 void
@@ -532,9 +841,7 @@ hildon_im_plugin_backspace(HildonIMPlugin *plugin)
   }
 
   if (iface->backspace)
-  {
-    iface->backspace(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, backspace, (plugin));
 }
 
 void
@@ -552,9 +859,7 @@ hildon_im_plugin_enter(HildonIMPlugin *plugin)
   }
 
   if (iface->enter)
-  {
-    iface->enter(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, enter, (plugin));
 }
 
 void
@@ -572,9 +877,7 @@ hildon_im_plugin_tab(HildonIMPlugin *plugin)
   }
 
   if (iface->tab)
-  {
-    iface->tab(plugin);
-  }
+    PLUGIN_DISPATCH(plugin, iface, tab, (plugin));
 }
 
 void
@@ -592,9 +895,7 @@ hildon_im_plugin_fullscreen(HildonIMPlugin *plugin, gboolean fullscreen)
   }
 
   if (iface->fullscreen)
-  {
-    iface->fullscreen(plugin, fullscreen);
-  }
+    PLUGIN_DISPATCH(plugin, iface, fullscreen, (plugin, fullscreen));
 }
 
 void
@@ -612,9 +913,7 @@ hildon_im_plugin_select_region(HildonIMPlugin *plugin, gint start, gint end)
   }
 
   if (iface->select_region)
-  {
-    iface->select_region(plugin, start, end);
-  }
+    PLUGIN_DISPATCH(plugin, iface, select_region, (plugin, start, end));
 }
 
 void
@@ -636,9 +935,7 @@ hildon_im_plugin_key_event(HildonIMPlugin *plugin,
   }
 
   if (iface->key_event)
-  {
-    iface->key_event(plugin, type, state, keyval, hardware_keycode);
-  }
+    PLUGIN_DISPATCH(plugin, iface, key_event, (plugin, type, state, keyval, hardware_keycode));
 }
 
 void
@@ -657,9 +954,7 @@ hildon_im_plugin_transition(HildonIMPlugin *plugin,
   }
 
   if (iface->transition)
-  {
-    iface->transition(plugin, from);
-  }
+    PLUGIN_DISPATCH(plugin, iface, transition, (plugin, from));
 }
 
 void
@@ -679,9 +974,7 @@ hildon_im_plugin_surrounding_received(HildonIMPlugin *plugin,
   }
 
   if (iface->surrounding_received)
-  {
-    iface->surrounding_received(plugin, surrounding, offset);
-  }
+    PLUGIN_DISPATCH(plugin, iface, surrounding_received, (plugin, surrounding, offset));
 }
 
 void
@@ -700,9 +993,45 @@ hildon_im_plugin_preedit_committed (HildonIMPlugin *plugin,
   }
 
   if (iface->preedit_committed)
+    PLUGIN_DISPATCH(plugin, iface, preedit_committed, (plugin, committed_preedit));
+}
+
+void
+hildon_im_plugin_memory_low (HildonIMPlugin *plugin)
+{
+  HildonIMPluginIface *iface=NULL;
+
+  g_return_if_fail(HILDON_IM_IS_PLUGIN(plugin));
+
+  iface = HILDON_IM_PLUGIN_GET_IFACE(plugin);
+
+  if (!iface)
   {
-    iface->preedit_committed(plugin, committed_preedit);
+    return;
   }
+
+  if (iface->memory_low)
+    PLUGIN_DISPATCH(plugin, iface, memory_low, (plugin));
+}
+
+HildonIMPluginInterest
+hildon_im_plugin_get_interests (HildonIMPlugin *plugin,
+                                const gchar * const **settings_prefixes)
+{
+  HildonIMPluginIface *iface=NULL;
+
+  *settings_prefixes = NULL;
+
+  g_return_val_if_fail(HILDON_IM_IS_PLUGIN(plugin), HILDON_IM_INTEREST_ALL);
+
+  iface = HILDON_IM_PLUGIN_GET_IFACE(plugin);
+
+  if (!iface || !iface->get_interests)
+  {
+    return HILDON_IM_INTEREST_ALL;
+  }
+
+  return iface->get_interests(plugin, settings_prefixes);
 }
 
 HildonIMPluginInfo *
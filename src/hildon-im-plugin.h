@@ -48,6 +48,29 @@ typedef struct _HildonIMPluginIface HildonIMPluginIface;
  * 
  * Common information that all plugins should provide.
  * 
+ * hildon-im-recache can read this information, together with the
+ * available languages, from a key file installed next to the plugin
+ * (foo.him for foo.so) instead of loading the plugin:
+ *
+ * |[
+ * [Plugin]
+ * Name=foo
+ * Trigger=finger
+ * Type=fullscreen
+ * Languages=en_GB;fi_FI;
+ * ]|
+ *
+ * Name and Trigger are required. Trigger is one of none, stylus, finger,
+ * keyboard or unknown. The optional keys are Description, MenuTitle,
+ * GettextDomain, SpecialPlugin and OssohelpId (strings), Priority and
+ * Height (integers), VisibleInMenu, Cached and DisableCommonButtons
+ * (booleans), Type (default, special, fullscreen, persistent, others,
+ * hidden or special-standalone), Group (latin, cjk or custom) and
+ * Languages (a list of the languages returned by
+ * hildon_im_plugin_get_available_languages()). Enumeration values are
+ * case insensitive and missing keys default to 0 or %NULL. A descriptor
+ * that cannot be parsed is ignored and the plugin is loaded instead.
+ *
  * @description: the plugin's description
  * @name: the plugin's name
  * @menu_title: the name given to the plugin in a menu. Deprecated: not used in Fremantle
@@ -127,6 +150,24 @@ typedef enum
   HILDON_IM_TYPE_SPECIAL_STANDALONE
 } HildonIMPluginType;
 
+/**
+ * HildonIMPluginInterest:
+ * @HILDON_IM_INTEREST_KEY_EVENT: hildon_im_plugin_key_event()
+ * @HILDON_IM_INTEREST_SETTINGS_CHANGED: hildon_im_plugin_settings_changed()
+ * @HILDON_IM_INTEREST_ALL: all of the above
+ *
+ * The callbacks delivered to every plugin that a plugin can opt out of,
+ * see hildon_im_plugin_get_interests().
+ */
+typedef enum
+{
+  HILDON_IM_INTEREST_KEY_EVENT        = 1 << 0,
+  HILDON_IM_INTEREST_SETTINGS_CHANGED = 1 << 1,
+
+  HILDON_IM_INTEREST_ALL = HILDON_IM_INTEREST_KEY_EVENT |
+                           HILDON_IM_INTEREST_SETTINGS_CHANGED
+} HildonIMPluginInterest;
+
 struct _HildonIMPluginIface
 {
   GTypeInterface base_iface;
@@ -163,6 +204,11 @@ struct _HildonIMPluginIface
   
   void (*preedit_committed) (HildonIMPlugin *plugin,
                              const gchar *committed_preedit);
+
+  void (*memory_low) (HildonIMPlugin *plugin);
+
+  HildonIMPluginInterest (*get_interests) (HildonIMPlugin *plugin,
+                                           const gchar * const **settings_prefixes);
 };
 
 /**
@@ -352,6 +398,32 @@ void hildon_im_plugin_surrounding_received(HildonIMPlugin *plugin,
 void hildon_im_plugin_preedit_committed (HildonIMPlugin *plugin,
                                          const gchar *committed_preedit);
 
+/**
+ * hildon_im_plugin_memory_low:
+ * @plugin: #HildonIMPlugin
+ *
+ * Called when the device runs low on memory, after
+ * hildon_im_plugin_save_data(). The plugin should drop whatever caches it
+ * can rebuild later, such as dictionaries or prediction data.
+ */
+void hildon_im_plugin_memory_low (HildonIMPlugin *plugin);
+
+/**
+ * hildon_im_plugin_get_interests:
+ * @plugin: #HildonIMPlugin
+ * @settings_prefixes: return location for a %NULL terminated array of
+ *   the GConf key prefixes the plugin wants settings_changed for, or
+ *   %NULL for all keys. The array is owned by the plugin and must stay
+ *   valid as long as the plugin.
+ *
+ * The UI may keep the answer for the lifetime of the plugin. Plugins that
+ * do not implement it receive every callback.
+ *
+ * Return value: the #HildonIMPluginInterest of the plugin
+ */
+HildonIMPluginInterest hildon_im_plugin_get_interests (HildonIMPlugin *plugin,
+                                                       const gchar * const **settings_prefixes);
+
 /**
  * hildon_im_plugin_duplicate_info:
  * @src: source
@@ -24,40 +24,124 @@
 #include <stdio.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <glib.h>
 #include "cache.h"
 #include "hildon-im-plugin.h"
 
-static gboolean
-write_int (FILE *f, gint i)
+/* Seconds a worker may spend on a single plugin before it is killed */
+#define PROBE_TIMEOUT 30
+
+#define DESCRIPTOR_SUFFIX ".him"
+#define DESCRIPTOR_GROUP  "Plugin"
+
+typedef struct
+{
+  const gchar *nick;
+  gint         value;
+} EnumNick;
+
+static const EnumNick type_nicks[] =
+{
+  { "default",            HILDON_IM_TYPE_DEFAULT },
+  { "special",            HILDON_IM_TYPE_SPECIAL },
+  { "fullscreen",         HILDON_IM_TYPE_FULLSCREEN },
+  { "persistent",         HILDON_IM_TYPE_PERSISTENT },
+  { "others",             HILDON_IM_TYPE_OTHERS },
+  { "hidden",             HILDON_IM_TYPE_HIDDEN },
+  { "special-standalone", HILDON_IM_TYPE_SPECIAL_STANDALONE },
+  { NULL, 0 }
+};
+
+static const EnumNick group_nicks[] =
+{
+  { "latin",  HILDON_IM_GROUP_LATIN },
+  { "cjk",    HILDON_IM_GROUP_CJK },
+  { "custom", HILDON_IM_GROUP_CUSTOM },
+  { NULL, 0 }
+};
+
+static const EnumNick trigger_nicks[] =
+{
+  { "none",     HILDON_IM_TRIGGER_NONE },
+  { "stylus",   HILDON_IM_TRIGGER_STYLUS },
+  { "finger",   HILDON_IM_TRIGGER_FINGER },
+  { "keyboard", HILDON_IM_TRIGGER_KEYBOARD },
+  { "unknown",  HILDON_IM_TRIGGER_UNKNOWN },
+  { NULL, 0 }
+};
+
+typedef struct
 {
-  return (fwrite (&i, 1, sizeof (gint), f) == sizeof (gint));
+  gchar                *name;
+  struct stat           st;
+  HildonIMCachePlugin   plugin;
+  gboolean              valid;
+  gboolean              resolved;
+} ProbeJob;
+
+typedef struct
+{
+  pid_t      pid;
+  gint       fd;
+  ProbeJob  *job;
+  GString   *data;
+  time_t     started;
+} ProbeWorker;
+
+typedef struct
+{
+  const gchar *data;
+  gsize        len;
+  gsize        pos;
+} ProbeReader;
+
+typedef struct
+{
+  GString    *data;
+  GHashTable *offsets;
+} StringPool;
+
+static void
+string_pool_init (StringPool *pool)
+{
+  pool->data = g_string_new (NULL);
+  /* Offset 0 is reserved for NULL */
+  g_string_append_c (pool->data, '\0');
+  pool->offsets = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
-static gboolean
-write_byte (FILE *f, gchar i)
+static void
+string_pool_free (StringPool *pool)
 {
-  return (fwrite (&i, 1, 1, f) == 1);
+  g_hash_table_destroy (pool->offsets);
+  g_string_free (pool->data, TRUE);
 }
 
-static gboolean
-write_string (FILE *f, gchar *s)
+static guint32
+string_pool_add (StringPool *pool, const gchar *s)
 {
-  gboolean retval = FALSE;
-  gint size;
-  
-  if (s == NULL)
-    size = 0;
-  else 
-    size = strlen (s);
+  gpointer offset;
 
-  retval = write_byte (f, (gchar) size);
-  if (size && retval)
-  {
-    retval &= (fwrite (s, 1, size, f) == size);
-  }
+  if (s == NULL || *s == '\0')
+    return 0;
 
-  return retval;
+  /* Only the offsets are stored in the table, the keys are the caller's
+   * strings which outlive the pool */
+  if (g_hash_table_lookup_extended (pool->offsets, s, NULL, &offset))
+    return GPOINTER_TO_UINT (offset);
+
+  offset = GUINT_TO_POINTER (pool->data->len);
+  g_string_append_len (pool->data, s, strlen (s) + 1);
+  g_hash_table_insert (pool->offsets, (gpointer) s, offset);
+
+  return GPOINTER_TO_UINT (offset);
 }
 
 static gint        
@@ -133,15 +217,275 @@ add_languages (GSList *main, gchar **sub)
   return TRUE; }
 
 
+static void
+copy_info (HildonIMPluginInfo *dest, const HildonIMPluginInfo *src)
+{
+  *dest = *src;
+  dest->description = g_strdup (src->description);
+  dest->name = g_strdup (src->name);
+  dest->menu_title = g_strdup (src->menu_title);
+  dest->gettext_domain = g_strdup (src->gettext_domain);
+  dest->special_plugin = g_strdup (src->special_plugin);
+  dest->ossohelp_id = g_strdup (src->ossohelp_id);
+}
+
+static void
+copy_plugin (HildonIMCachePlugin *dest, const HildonIMCachePlugin *src)
+{
+  GSList *iter;
+
+  *dest = *src;
+  dest->record = NULL;
+  dest->filename = g_strdup (src->filename);
+  dest->languages = NULL;
+  for (iter = src->languages; iter != NULL; iter = iter->next)
+    dest->languages = g_slist_prepend (dest->languages, g_strdup (iter->data));
+  dest->languages = g_slist_reverse (dest->languages);
+  copy_info (&dest->info, &src->info);
+}
+
+static GHashTable *
+load_previous_cache (HildonIMCache **previous)
+{
+  GHashTable *table;
+  gchar *filename;
+  guint i;
+
+  *previous = NULL;
+
+  filename = get_cache_file (CACHE_FILENAME);
+  if (g_file_test (filename, G_FILE_TEST_EXISTS))
+    *previous = cache_open ();
+  g_free (filename);
+
+  if (*previous == NULL)
+    return NULL;
+
+  table = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < (*previous)->num_plugins; i++)
+  {
+    HildonIMCachePlugin *plugin = &(*previous)->plugins [i];
+
+    if (plugin->filename != NULL)
+      g_hash_table_insert (table, plugin->filename, plugin);
+  }
+
+  return table;
+}
+
+static gboolean
+descriptor_get_enum (GKeyFile *key_file, const gchar *key,
+                     const EnumNick *nicks, gint *value, GError **error)
+{
+  gchar *str, *end;
+  gint i;
+
+  str = g_key_file_get_string (key_file, DESCRIPTOR_GROUP, key, error);
+  if (str == NULL)
+    return FALSE;
+
+  g_strstrip (str);
+  for (i = 0; nicks[i].nick != NULL; i++)
+  {
+    if (g_ascii_strcasecmp (str, nicks[i].nick) == 0)
+    {
+      *value = nicks[i].value;
+      g_free (str);
+      return TRUE;
+    }
+  }
+
+  /* Plain numbers are accepted as well */
+  *value = (gint) g_ascii_strtoll (str, &end, 0);
+  if (*str == '\0' || *end != '\0')
+  {
+    g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                 "Invalid value \"%s\" for key %s", str, key);
+    g_free (str);
+    return FALSE;
+  }
+
+  g_free (str);
+  return TRUE;
+}
+
+static gboolean
+descriptor_get_optional_enum (GKeyFile *key_file, const gchar *key,
+                              const EnumNick *nicks, gint *value,
+                              GError **error)
+{
+  if (!g_key_file_has_key (key_file, DESCRIPTOR_GROUP, key, NULL))
+    return TRUE;
+
+  return descriptor_get_enum (key_file, key, nicks, value, error);
+}
+
+static gboolean
+descriptor_get_optional_int (GKeyFile *key_file, const gchar *key,
+                             gint *value, GError **error)
+{
+  GError *local_error = NULL;
+  gint v;
+
+  if (!g_key_file_has_key (key_file, DESCRIPTOR_GROUP, key, NULL))
+    return TRUE;
+
+  v = g_key_file_get_integer (key_file, DESCRIPTOR_GROUP, key, &local_error);
+  if (local_error != NULL)
+  {
+    g_propagate_error (error, local_error);
+    return FALSE;
+  }
+
+  *value = v;
+  return TRUE;
+}
+
+static gboolean
+descriptor_get_optional_boolean (GKeyFile *key_file, const gchar *key,
+                                 gboolean *value, GError **error)
+{
+  GError *local_error = NULL;
+  gboolean v;
+
+  if (!g_key_file_has_key (key_file, DESCRIPTOR_GROUP, key, NULL))
+    return TRUE;
+
+  v = g_key_file_get_boolean (key_file, DESCRIPTOR_GROUP, key, &local_error);
+  if (local_error != NULL)
+  {
+    g_propagate_error (error, local_error);
+    return FALSE;
+  }
+
+  *value = v;
+  return TRUE;
+}
+
+/* Fills plugin from the descriptor installed next to the .so, e.g.
+ *
+ *   [Plugin]
+ *   Name=foo
+ *   Trigger=finger
+ *   Type=fullscreen
+ *   Languages=en_GB;fi_FI;
+ *
+ * Name and Trigger are required, every other key of #HildonIMPluginInfo
+ * (Description, MenuTitle, GettextDomain, VisibleInMenu, Cached, Type,
+ * Group, Priority, SpecialPlugin, OssohelpId, DisableCommonButtons,
+ * Height) defaults to 0 or NULL. */
+static gboolean
+read_descriptor (const gchar *descriptor, const gchar *soname,
+                 HildonIMCachePlugin *plugin, GError **error)
+{
+  HildonIMPluginInfo *info = &plugin->info;
+  GKeyFile *key_file;
+  gchar **languages;
+  gboolean retval;
+
+  key_file = g_key_file_new ();
+  if (!g_key_file_load_from_file (key_file, descriptor,
+                                  G_KEY_FILE_NONE, error))
+  {
+    g_key_file_free (key_file);
+    return FALSE;
+  }
+
+  info->name = g_key_file_get_string (key_file, DESCRIPTOR_GROUP, "Name",
+                                      error);
+  retval = info->name != NULL &&
+           descriptor_get_enum (key_file, "Trigger", trigger_nicks,
+                                (gint *) &info->trigger, error) &&
+           descriptor_get_optional_enum (key_file, "Type", type_nicks,
+                                         &info->type, error) &&
+           descriptor_get_optional_enum (key_file, "Group", group_nicks,
+                                         &info->group, error) &&
+           descriptor_get_optional_int (key_file, "Priority",
+                                        &info->priority, error) &&
+           descriptor_get_optional_int (key_file, "Height",
+                                        &info->height, error) &&
+           descriptor_get_optional_boolean (key_file, "VisibleInMenu",
+                                            &info->visible_in_menu, error) &&
+           descriptor_get_optional_boolean (key_file, "Cached",
+                                            &info->cached, error) &&
+           descriptor_get_optional_boolean (key_file, "DisableCommonButtons",
+                                            &info->disable_common_buttons,
+                                            error);
+
+  if (retval)
+  {
+    info->description = g_key_file_get_string (key_file, DESCRIPTOR_GROUP,
+                                               "Description", NULL);
+    info->menu_title = g_key_file_get_string (key_file, DESCRIPTOR_GROUP,
+                                              "MenuTitle", NULL);
+    info->gettext_domain = g_key_file_get_string (key_file, DESCRIPTOR_GROUP,
+                                                  "GettextDomain", NULL);
+    info->special_plugin = g_key_file_get_string (key_file, DESCRIPTOR_GROUP,
+                                                  "SpecialPlugin", NULL);
+    info->ossohelp_id = g_key_file_get_string (key_file, DESCRIPTOR_GROUP,
+                                               "OssohelpId", NULL);
+
+    languages = g_key_file_get_string_list (key_file, DESCRIPTOR_GROUP,
+                                            "Languages", NULL, NULL);
+    plugin->languages = add_languages (NULL, languages);
+    g_strfreev (languages);
+
+    plugin->filename = g_strdup (soname);
+  }
+  else
+  {
+    cache_plugin_clear (plugin);
+    memset (plugin, 0, sizeof (HildonIMCachePlugin));
+  }
+
+  g_key_file_free (key_file);
+  return retval;
+}
+
+/* Returns TRUE if the job could be resolved from a descriptor file */
+static gboolean
+resolve_from_descriptor (const gchar *dirname, ProbeJob *job)
+{
+  GError *error = NULL;
+  gchar *basename, *descriptor, *soname;
+  gboolean retval = FALSE;
+
+  basename = g_strndup (job->name, strlen (job->name) - strlen (".so"));
+  descriptor = g_strconcat (dirname, G_DIR_SEPARATOR_S, basename,
+                            DESCRIPTOR_SUFFIX, NULL);
+  g_free (basename);
+
+  if (g_file_test (descriptor, G_FILE_TEST_IS_REGULAR))
+  {
+    soname = g_build_filename (dirname, job->name, NULL);
+    if (read_descriptor (descriptor, soname, &job->plugin, &error))
+    {
+      g_print ("Processing: %s (from %s)\n", job->name, descriptor);
+      /* No stat signature: the descriptor is read again on every run */
+      job->valid = job->resolved = TRUE;
+      retval = TRUE;
+    }
+    else
+    {
+      g_warning ("Invalid descriptor %s (%s), loading the plugin instead",
+                 descriptor, error->message);
+      g_error_free (error);
+    }
+    g_free (soname);
+  }
+
+  g_free (descriptor);
+  return retval;
+}
+
 static gboolean
 cache_file (const gchar *dir, 
-    const gchar *name, FILE *file, gboolean *valid)
+    const gchar *name, HildonIMCachePlugin *plugin, gboolean *valid)
 {
-  gboolean           retval = TRUE;
   gboolean           should_be_free;
   gchar             *soname;
   gchar             **sub;
-  GSList            *language_list = NULL, *iter;
+  GSList            *language_list = NULL;
 
   void              *handle = NULL;
   typedef gchar     **(*get_lang_func)(gboolean *);
@@ -196,55 +540,490 @@ cache_file (const gchar *dir,
 
   plugin_info = (*infofunc)();
 
-  retval &= write_string (file, soname);
+  /* The strings belong to the plugin, copy them before closing it */
+  plugin->filename = soname;
+  plugin->languages = language_list;
+  copy_info (&plugin->info, plugin_info);
 
-  /* Number of languages */
-  if (retval)
-    retval &= write_byte (file, g_slist_length (language_list));
-  else
-    _EXIT;
+  dlclose(handle); /* Close it for now. */  
 
-  /* Language list */
-  iter = language_list;
-  while (iter)
+  *valid = TRUE;
+  return TRUE;
+}
+
+/* Records travel from the workers to the parent in host byte order: both
+ * ends are the same binary.  A string is its length followed by the bytes,
+ * G_MAXUINT32 stands for NULL. */
+static void
+put_uint32 (GString *out, guint32 value)
+{
+  g_string_append_len (out, (const gchar *) &value, sizeof (guint32));
+}
+
+static void
+put_string (GString *out, const gchar *s)
+{
+  if (s == NULL)
   {
-    gchar *data = (gchar *) iter->data;
-    
-    retval &= write_string (file, data);
-    if (retval == FALSE) 
+    put_uint32 (out, G_MAXUINT32);
+    return;
+  }
+
+  put_uint32 (out, strlen (s));
+  g_string_append (out, s);
+}
+
+static void
+serialize_plugin (GString *out, const HildonIMCachePlugin *plugin)
+{
+  const HildonIMPluginInfo *info = &plugin->info;
+  GSList *iter;
+
+  put_string (out, plugin->filename);
+  put_uint32 (out, g_slist_length (plugin->languages));
+  for (iter = plugin->languages; iter != NULL; iter = iter->next)
+    put_string (out, iter->data);
+
+  put_string (out, info->description);
+  put_string (out, info->name);
+  put_string (out, info->menu_title);
+  put_string (out, info->gettext_domain);
+  put_string (out, info->special_plugin);
+  put_string (out, info->ossohelp_id);
+  put_uint32 (out, info->visible_in_menu);
+  put_uint32 (out, info->cached);
+  put_uint32 (out, info->type);
+  put_uint32 (out, info->group);
+  put_uint32 (out, info->priority);
+  put_uint32 (out, info->disable_common_buttons);
+  put_uint32 (out, info->height);
+  put_uint32 (out, info->trigger);
+}
+
+static gboolean
+get_uint32 (ProbeReader *reader, guint32 *value)
+{
+  if (reader->len - reader->pos < sizeof (guint32))
+    return FALSE;
+
+  memcpy (value, reader->data + reader->pos, sizeof (guint32));
+  reader->pos += sizeof (guint32);
+  return TRUE;
+}
+
+static gboolean
+get_int (ProbeReader *reader, gint *value)
+{
+  guint32 v;
+
+  if (!get_uint32 (reader, &v))
+    return FALSE;
+
+  *value = (gint32) v;
+  return TRUE;
+}
+
+static gboolean
+get_string (ProbeReader *reader, gchar **s)
+{
+  guint32 len;
+
+  *s = NULL;
+  if (!get_uint32 (reader, &len))
+    return FALSE;
+
+  if (len == G_MAXUINT32)
+    return TRUE;
+
+  if (reader->len - reader->pos < len)
+    return FALSE;
+
+  *s = g_strndup (reader->data + reader->pos, len);
+  reader->pos += len;
+  return TRUE;
+}
+
+static gboolean
+deserialize_plugin (ProbeReader *reader, HildonIMCachePlugin *plugin)
+{
+  HildonIMPluginInfo *info = &plugin->info;
+  guint32 num_languages, i;
+
+  if (!get_string (reader, &plugin->filename) ||
+      !get_uint32 (reader, &num_languages))
+    return FALSE;
+
+  for (i = 0; i < num_languages; i++)
+  {
+    gchar *language;
+
+    if (!get_string (reader, &language))
+      return FALSE;
+    plugin->languages = g_slist_prepend (plugin->languages, language);
+  }
+  plugin->languages = g_slist_reverse (plugin->languages);
+
+  return get_string (reader, &info->description) &&
+         get_string (reader, &info->name) &&
+         get_string (reader, &info->menu_title) &&
+         get_string (reader, &info->gettext_domain) &&
+         get_string (reader, &info->special_plugin) &&
+         get_string (reader, &info->ossohelp_id) &&
+         get_int (reader, &info->visible_in_menu) &&
+         get_int (reader, &info->cached) &&
+         get_int (reader, &info->type) &&
+         get_int (reader, &info->group) &&
+         get_int (reader, &info->priority) &&
+         get_int (reader, &info->disable_common_buttons) &&
+         get_int (reader, &info->height) &&
+         get_int (reader, (gint *) &info->trigger) &&
+         reader->pos == reader->len;
+}
+
+static gboolean
+write_all (gint fd, const gchar *data, gsize len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write (fd, data, len);
+
+    if (n < 0)
     {
-      g_warning ("Failed writing the language_list");
-      _EXIT;
+      if (errno == EINTR)
+        continue;
+      return FALSE;
     }
+    data += n;
+    len -= n;
+  }
+
+  return TRUE;
+}
+
+/* Runs in the forked child: probe one plugin and report back on fd. The
+ * first byte tells whether the .so is an input method plugin at all. */
+static void
+probe_in_child (gint fd, const gchar *dirname, ProbeJob *job)
+{
+  HildonIMCachePlugin plugin;
+  GString *out;
+  gboolean valid, ok;
 
-    iter = g_slist_next (iter);
+  memset (&plugin, 0, sizeof (HildonIMCachePlugin));
+  if (cache_file (dirname, job->name, &plugin, &valid) == FALSE)
+  {
+    fflush (stdout);
+    _exit (1);
   }
 
-  retval &= write_string (file, plugin_info->description);
-  retval &= write_string (file, plugin_info->name);
-  retval &= write_string (file, plugin_info->menu_title);
-  retval &= write_string (file, plugin_info->gettext_domain);
-  retval &= write_byte (file, plugin_info->visible_in_menu);
-  retval &= write_byte (file, plugin_info->cached);
-  retval &= write_int (file, plugin_info->type);
-  retval &= write_int (file, plugin_info->group);
-  retval &= write_int (file, plugin_info->priority);
-  retval &= write_string (file, plugin_info->special_plugin);
-  retval &= write_string (file, plugin_info->ossohelp_id);
-  retval &= write_byte (file, plugin_info->disable_common_buttons);
-  retval &= write_int (file, plugin_info->height);
-  retval &= write_int (file, plugin_info->trigger);
-
-  free_language_list (language_list);
-  dlclose(handle); /* Close it for now. */  
-  g_free (soname);
+  out = g_string_new (NULL);
+  g_string_append_c (out, valid ? 1 : 0);
+  if (valid)
+    serialize_plugin (out, &plugin);
+
+  ok = write_all (fd, out->str, out->len);
+  fflush (stdout);
+  _exit (ok ? 0 : 1);
+}
+
+static gboolean
+spawn_worker (ProbeWorker *worker, const gchar *dirname, ProbeJob *job)
+{
+  gint fds[2];
+
+  if (pipe (fds) != 0)
+    return FALSE;
+
+  /* Anything still buffered would otherwise be printed twice */
+  fflush (stdout);
+  fflush (stderr);
+
+  worker->pid = fork ();
+  if (worker->pid < 0)
+  {
+    close (fds[0]);
+    close (fds[1]);
+    return FALSE;
+  }
+
+  if (worker->pid == 0)
+  {
+    close (fds[0]);
+    probe_in_child (fds[1], dirname, job);
+  }
+
+  close (fds[1]);
+  worker->fd = fds[0];
+  worker->job = job;
+  worker->data = g_string_new (NULL);
+  worker->started = time (NULL);
+
+  return TRUE;
+}
+
+static void
+finish_worker (ProbeWorker *worker)
+{
+  ProbeJob *job = worker->job;
+  gint status;
+
+  close (worker->fd);
+  while (waitpid (worker->pid, &status, 0) < 0 && errno == EINTR)
+    ;
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0 ||
+      worker->data->len == 0)
+  {
+    if (WIFSIGNALED (status))
+      g_warning ("Probing %s failed (signal %d), skipping it",
+                 job->name, WTERMSIG (status));
+    else
+      g_warning ("Probing %s failed, skipping it", job->name);
+  }
+  else if (worker->data->str[0] != 0)
+  {
+    ProbeReader reader;
+
+    reader.data = worker->data->str;
+    reader.len = worker->data->len;
+    reader.pos = 1;
+
+    if (deserialize_plugin (&reader, &job->plugin))
+    {
+      cache_plugin_set_stat (&job->plugin, &job->st);
+      job->valid = TRUE;
+    }
+    else
+    {
+      g_warning ("Invalid record received for %s, skipping it", job->name);
+      cache_plugin_clear (&job->plugin);
+      memset (&job->plugin, 0, sizeof (HildonIMCachePlugin));
+    }
+  }
+
+  g_string_free (worker->data, TRUE);
+  worker->data = NULL;
+  worker->job = NULL;
+  worker->pid = 0;
+  worker->fd = -1;
+}
+
+/* Probes the pending jobs in up to num_workers forked processes. The
+ * results are stored in the jobs themselves, so the order of the cache
+ * does not depend on which worker finishes first. */
+static void
+probe_in_workers (const gchar *dirname, GArray *jobs, guint num_workers)
+{
+  ProbeWorker *workers;
+  struct pollfd *fds;
+  guint next = 0, active = 0, i;
+
+  workers = g_new0 (ProbeWorker, num_workers);
+  fds = g_new0 (struct pollfd, num_workers);
+
+  while (TRUE)
+  {
+    time_t now;
+    gint n;
+
+    for (i = 0; i < num_workers && next < jobs->len; i++)
+    {
+      ProbeJob *job;
+
+      if (workers[i].job != NULL)
+        continue;
+
+      while (next < jobs->len &&
+             g_array_index (jobs, ProbeJob, next).resolved)
+        next++;
+      if (next == jobs->len)
+        break;
+
+      job = &g_array_index (jobs, ProbeJob, next++);
+      if (spawn_worker (&workers[i], dirname, job))
+        active++;
+      else
+        g_warning ("Unable to start a worker for %s, skipping it", job->name);
+    }
+
+    if (active == 0)
+    {
+      if (next < jobs->len)
+        continue;
+      break;
+    }
+
+    for (i = 0; i < num_workers; i++)
+    {
+      fds[i].fd = workers[i].job != NULL ? workers[i].fd : -1;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+
+    n = poll (fds, num_workers, 1000);
+    if (n < 0 && errno != EINTR)
+    {
+      g_warning ("poll() failed: %s", g_strerror (errno));
+      break;
+    }
+
+    now = time (NULL);
+    for (i = 0; i < num_workers; i++)
+    {
+      ProbeWorker *worker = &workers[i];
+
+      if (worker->job == NULL)
+        continue;
+
+      if (fds[i].revents != 0)
+      {
+        gchar buf[4096];
+        ssize_t len = read (worker->fd, buf, sizeof (buf));
+
+        if (len > 0)
+        {
+          g_string_append_len (worker->data, buf, len);
+          continue;
+        }
+        if (len < 0 && errno == EINTR)
+          continue;
+
+        finish_worker (worker);
+        active--;
+      }
+      else if (now - worker->started > PROBE_TIMEOUT)
+      {
+        g_warning ("Probing %s timed out", worker->job->name);
+        kill (worker->pid, SIGKILL);
+        g_string_truncate (worker->data, 0);
+        finish_worker (worker);
+        active--;
+      }
+    }
+  }
+
+  /* Only reached early if poll() broke down */
+  for (i = 0; i < num_workers; i++)
+  {
+    if (workers[i].job != NULL)
+    {
+      kill (workers[i].pid, SIGKILL);
+      g_string_truncate (workers[i].data, 0);
+      finish_worker (&workers[i]);
+    }
+  }
+
+  g_free (fds);
+  g_free (workers);
+}
+
+static gint
+job_compare (gconstpointer a, gconstpointer b)
+{
+  return strcmp (((const ProbeJob *) a)->name, ((const ProbeJob *) b)->name);
+}
+
+static gboolean
+write_cache (FILE *f, GArray *plugins)
+{
+  CacheHeader header;
+  StringPool pool;
+  GArray *records, *languages;
+  guint32 records_offset, records_size, languages_offset, strings_offset;
+  gboolean retval;
+  guint i;
+
+  string_pool_init (&pool);
+  records = g_array_sized_new (FALSE, TRUE, sizeof (CacheRecord), plugins->len);
+  languages = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (i = 0; i < plugins->len; i++)
+  {
+    HildonIMCachePlugin *plugin = &g_array_index (plugins,
+                                                  HildonIMCachePlugin, i);
+    HildonIMPluginInfo *info = &plugin->info;
+    CacheRecord record;
+    GSList *iter;
+    guint32 first;
+
+    memset (&record, 0, sizeof (CacheRecord));
+    record.length = GUINT32_TO_LE (sizeof (CacheRecord));
+    record.filename = GUINT32_TO_LE (string_pool_add (&pool,
+                                                      plugin->filename));
+
+    first = languages->len;
+    for (iter = plugin->languages; iter != NULL; iter = iter->next)
+    {
+      guint32 offset = GUINT32_TO_LE (string_pool_add (&pool, iter->data));
+      g_array_append_val (languages, offset);
+    }
+    record.languages = GUINT32_TO_LE (first);
+    record.num_languages = GUINT32_TO_LE (languages->len - first);
+
+    record.description = GUINT32_TO_LE (string_pool_add (&pool,
+                                                         info->description));
+    record.name = GUINT32_TO_LE (string_pool_add (&pool, info->name));
+    record.menu_title = GUINT32_TO_LE (string_pool_add (&pool,
+                                                        info->menu_title));
+    record.gettext_domain = GUINT32_TO_LE (string_pool_add (&pool,
+                                                info->gettext_domain));
+    record.special_plugin = GUINT32_TO_LE (string_pool_add (&pool,
+                                                info->special_plugin));
+    record.ossohelp_id = GUINT32_TO_LE (string_pool_add (&pool,
+                                                         info->ossohelp_id));
+
+    record.type = GINT32_TO_LE (info->type);
+    record.group = GINT32_TO_LE (info->group);
+    record.priority = GINT32_TO_LE (info->priority);
+    record.height = GINT32_TO_LE (info->height);
+    record.trigger = GINT32_TO_LE (info->trigger);
+    record.visible_in_menu = (info->visible_in_menu != FALSE);
+    record.cached = (info->cached != FALSE);
+    record.disable_common_buttons = (info->disable_common_buttons != FALSE);
+
+    record.mtime_nsec = GUINT32_TO_LE (plugin->mtime_nsec);
+    record.inode = GUINT64_TO_LE (plugin->inode);
+    record.size = GUINT64_TO_LE (plugin->size);
+    record.mtime = GINT64_TO_LE (plugin->mtime);
+
+    g_array_append_val (records, record);
+  }
+
+  /* All the sections are multiples of 4 bytes long, so every table
+   * stays aligned for the mapped reader */
+  records_offset = sizeof (CacheHeader);
+  records_size = records->len * sizeof (CacheRecord);
+  languages_offset = records_offset + records_size;
+  strings_offset = languages_offset + languages->len * sizeof (guint32);
+
+  memset (&header, 0, sizeof (CacheHeader));
+  memcpy (header.signature, CACHE_SIGNATURE, sizeof (header.signature));
+  header.version = CACHE_VERSION;
+  header.num_plugins = GUINT32_TO_LE (records->len);
+  header.records_size = GUINT32_TO_LE (records_size);
+  header.records_offset = GUINT32_TO_LE (records_offset);
+  header.languages_offset = GUINT32_TO_LE (languages_offset);
+  header.num_languages = GUINT32_TO_LE (languages->len);
+  header.strings_offset = GUINT32_TO_LE (strings_offset);
+  header.strings_size = GUINT32_TO_LE (pool.data->len);
+
+  retval = (fwrite (&header, 1, sizeof (CacheHeader), f) ==
+            sizeof (CacheHeader));
+  retval &= (fwrite (records->data, sizeof (CacheRecord), records->len, f) ==
+             records->len);
+  retval &= (fwrite (languages->data, sizeof (guint32), languages->len, f) ==
+             languages->len);
+  retval &= (fwrite (pool.data->str, 1, pool.data->len, f) == pool.data->len);
+
+  g_array_free (records, TRUE);
+  g_array_free (languages, TRUE);
+  string_pool_free (&pool);
 
-  *valid = TRUE;
   return retval;
 }
 
 static gboolean
-generate_cache (void)
+generate_cache (gboolean full, guint num_workers)
 {
   FILE *f;
   gchar *filename, *target_filename;
@@ -259,59 +1038,135 @@ generate_cache (void)
       const gchar *entry;
       gchar *dirname;
       GDir *dir;
-      gint num_plugins = 0;
+      GArray *plugins;
+      HildonIMCache *previous = NULL;
+      GHashTable *unchanged = NULL;
+      guint i, reused = 0;
 
-      /* Signature */
-      retval = (fwrite (CACHE_SIGNATURE, 
-            1, sizeof (CACHE_SIGNATURE) - 1, f) ==
-          (sizeof (CACHE_SIGNATURE) - 1));
+      plugins = g_array_new (FALSE, TRUE, sizeof (HildonIMCachePlugin));
 
-      retval &= write_byte (f, CACHE_VERSION);
-      retval &= write_byte (f, 0);
-      if (retval)
+      if (!full)
+        unchanged = load_previous_cache (&previous);
+
+      dirname = get_cache_file (CACHE_DIRECTORY);
+      if (dirname)
       {
-        dirname = get_cache_file (CACHE_DIRECTORY);
-        if (dirname)
+        dir = g_dir_open (dirname, 0, NULL);
+        if (dir) 
         {
-          dir = g_dir_open (dirname, 0, NULL);
-          if (dir) 
+          GArray *jobs;
+
+          retval = TRUE;
+          jobs = g_array_new (FALSE, TRUE, sizeof (ProbeJob));
+
+          while ((entry = g_dir_read_name (dir)) != NULL)
+          {             
+            ProbeJob job;
+            HildonIMCachePlugin *old = NULL;
+            gchar *soname;
+
+            if (!g_str_has_suffix (entry, ".so"))
+              continue;
+
+            memset (&job, 0, sizeof (ProbeJob));
+            job.name = g_strdup (entry);
+
+            if (resolve_from_descriptor (dirname, &job))
+            {
+              g_array_append_val (jobs, job);
+              continue;
+            }
+
+            soname = g_build_filename (dirname, entry, NULL);
+            if (stat (soname, &job.st) != 0)
+            {
+              g_warning ("Unable to stat %s", soname);
+              g_free (soname);
+              g_free (job.name);
+              continue;
+            }
+
+            if (unchanged != NULL)
+              old = g_hash_table_lookup (unchanged, soname);
+            g_free (soname);
+
+            /* The .so has not changed since the last run, there is no
+             * need to load it again */
+            if (old != NULL && cache_plugin_is_current (old, &job.st))
+            {
+              cache_plugin_get_info (previous, old);
+              copy_plugin (&job.plugin, old);
+              job.valid = job.resolved = TRUE;
+              reused++;
+            }
+
+            g_array_append_val (jobs, job);
+          }
+          g_dir_close (dir);
+
+          /* Keep the cache independent of the directory order */
+          g_array_sort (jobs, job_compare);
+
+          if (num_workers > 0)
+          {
+            probe_in_workers (dirname, jobs, num_workers);
+          }
+          else
           {
-            while ((entry = g_dir_read_name (dir)) != NULL)
-            {             
-              gboolean valid;
-              if (cache_file (dirname, entry, f, &valid) == FALSE)
+            for (i = 0; i < jobs->len; i++)
+            {
+              ProbeJob *job = &g_array_index (jobs, ProbeJob, i);
+
+              if (job->resolved)
+                continue;
+
+              if (cache_file (dirname, job->name,
+                              &job->plugin, &job->valid) == FALSE)
               {
-                g_warning ("Unable writing file %s when caching %s",
-                    filename, entry);
+                g_warning ("Unable to cache %s", job->name);
                 break;
-              } else {
-                retval = TRUE;
-                if (valid)
-                  num_plugins ++;
               }
+
+              if (job->valid)
+                cache_plugin_set_stat (&job->plugin, &job->st);
             }
-            g_dir_close (dir);
-          } else 
+          }
+
+          for (i = 0; i < jobs->len; i++)
           {
-            g_warning ("Unable to open directory %s", dirname);
-            retval = FALSE;
+            ProbeJob *job = &g_array_index (jobs, ProbeJob, i);
+
+            if (job->valid)
+              g_array_append_val (plugins, job->plugin);
+            g_free (job->name);
           }
-          g_free (dirname);
-        } else {
-          retval = FALSE;
-        }       
+          g_array_free (jobs, TRUE);
+        } else 
+        {
+          g_warning ("Unable to open directory %s", dirname);
+        }
+        g_free (dirname);
       }
 
       if (retval)
       {
-        if (fseek (f, CACHE_START_OFFSET, SEEK_SET) != 0)
-          retval = FALSE;
-
-        g_print ("Number of plugins processed: %d\n", num_plugins);
-        retval &= write_byte (f, (gchar) num_plugins);
+        g_print ("Number of plugins processed: %d (%d unchanged)\n",
+                 plugins->len, reused);
+        retval = write_cache (f, plugins);
+        if (!retval)
+          g_warning ("Unable writing file %s", filename);
       }
-      
-      fclose (f);
+
+      for (i = 0; i < plugins->len; i++)
+        cache_plugin_clear (&g_array_index (plugins, HildonIMCachePlugin, i));
+      g_array_free (plugins, TRUE);
+
+      if (unchanged != NULL)
+        g_hash_table_destroy (unchanged);
+      cache_close (previous);
+
+      if (fclose (f) != 0)
+        retval = FALSE;
       
       if (retval)
       {
@@ -319,6 +1174,15 @@ generate_cache (void)
 
         if (rename (filename, target_filename) != 0)
           retval = FALSE;
+        else if (!cache_stamp ())
+          g_warning ("Unable to set the modification time of %s",
+                     target_filename);
+
+        g_free (target_filename);
+      }
+      else
+      {
+        unlink (filename);
       }
     }
     else
@@ -333,9 +1197,33 @@ generate_cache (void)
 }
 
 int
-main (void)
+main (int argc, char *argv[])
 {
-  if (generate_cache () == FALSE)
+  GOptionContext *context;
+  GError *error = NULL;
+  gboolean full = FALSE;
+  gint jobs = 0;
+  GOptionEntry entries[] =
+  {
+    { "full", 'f', 0, G_OPTION_ARG_NONE, &full,
+      "Load every plugin again, even the unchanged ones", NULL },
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+      "Load the plugins in N separate processes", "N" },
+    { NULL }
+  };
+
+  context = g_option_context_new ("- update the input method plugin cache");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+  {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (context);
+    return -1;
+  }
+  g_option_context_free (context);
+
+  if (generate_cache (full, MAX (jobs, 0)) == FALSE)
     return -1;
 
   return 0;
@@ -28,6 +28,7 @@
  **/
 
 #include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <gdk/gdkx.h>
 #include <gdk/gdkkeysyms.h>
 #include <gtk/gtkicontheme.h>
@@ -48,6 +49,10 @@
 #include <config.h>
 #include <string.h>
 #include <dbus/dbus.h>
+#include <sys/wait.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
 
 #include "hildon-im-ui.h"
 #include "hildon-im-plugin.h"
@@ -56,6 +61,9 @@
 #include "hildon-im-xcode.h"
 #include "internal.h"
 #include "cache.h"
+#include "profile.h"
+#include "metrics.h"
+#include "probes.h"
 
 #define MAD_SERVICE "com.nokia.AS_DIMMED_infoprint"
 
@@ -63,6 +71,11 @@
 
 #define IM_MENU_DIR   PREFIX "/share/hildon-input-method"
 
+#define RECACHE_PATH  BINDIR "/hildon-im-recache"
+
+/* Wait for the cache file to settle before reloading it */
+#define CACHE_RELOAD_DELAY 500
+
 #define SOUND_PREFIX PREFIX "/share/sounds/"
 #define ILLEGAL_CHARACTER_SOUND_PATH SOUND_PREFIX "ui-default_beep.wav"
 #define NUMBER_INPUT_SOUND_PATH SOUND_PREFIX "ui-gesture_number_recognized.wav"
@@ -79,6 +92,10 @@
 #define GCONF_EXT_KB_LONG_PRESS_DISABLED HILDON_IM_GCONF_DIR "/ext_kb_repeat_enabled"
 #define GCONF_EXT_KB_LONG_PRESS_TIMEOUT  HILDON_IM_GCONF_DIR "/ext_kb_long_press_timeout"
 
+#define GCONF_WIDGET_POOL_SIZE       HILDON_IM_GCONF_DIR "/widget-pool-size"
+#define GCONF_WIDGET_POOL_BUDGET     HILDON_IM_GCONF_DIR "/widget-pool-budget"
+#define GCONF_PLUGIN_UNLOAD_DELAY    HILDON_IM_GCONF_DIR "/plugin-unload-delay"
+
 #define SOUND_REPEAT_ILLEGAL_CHARACTER 800
 #define SOUND_REPEAT_NUMBER_INPUT 0
 #define SOUND_REPEAT_FINGER_TRIGGER 1500
@@ -89,6 +106,15 @@
 
 #define BUFFER_SIZE 128
 
+/* Key presses tracked for the key to commit latency, and the longest
+ * latency taken as caused by the key rather than by a later tap */
+#define KEY_LATENCY_SLOTS 8
+#define KEY_LATENCY_MAX (2 * G_USEC_PER_SEC)
+
+/* Texts shorter than this many ClientMessage pieces are not worth the
+ * property round trip of the client, see send_bulk_text() */
+#define BULK_TEXT_MIN_LENGTH (4 * HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE)
+
 #define THUMB_LAUNCHES_FULLSCREEN_PLUGIN TRUE
 
 /* CURRENT_PLUGIN is the current PluginData */
@@ -114,19 +140,59 @@ static const gchar *language_gconf [NUM_LANGUAGES] =
   HILDON_IM_GCONF_SECONDARY_LANGUAGE
 };
 
+/* A forwarded key press, see note_key_event() */
 typedef struct {
-  HildonIMPluginInfo  *info;
+  guint keyval;
+  gint64 time;
+} PendingKeyPress;
+
+typedef struct {
+  HildonIMPluginInfo  *info;      /* see cache_plugin_get_info() */
   GSList              *languages;
   GtkWidget           *widget;    /* actual IM plugin */
   gboolean            enabled;
+  gboolean            prewarmed;  /* created ahead of use, kept on flush */
 
   gchar               *filename;
+  guint64             file_size;
+  GList               *pool_link; /* in widget_pool while hidden there */
+  gsize               pool_cost;
+
+  /* see hildon_im_plugin_get_interests() */
+  const gchar * const *settings_prefixes;
+  MetricsHistogram    *key_latency; /* looked up on its first sample */
 } PluginData;
 
+/* Lookup tables over a list of PluginData. by_trigger_type is keyed by
+ * TRIGGER_TYPE_KEY; -1 as trigger or type matches any value. */
 typedef struct {
-  HildonIMTrigger trigger;
-  gint            type;
-} TriggerType;
+  GHashTable *by_name;
+  GHashTable *by_filename;
+  GHashTable *by_trigger_type;
+} PluginRegistry;
+
+/* Slots of default_plugins, from HILDON_IM_TRIGGER_NONE on */
+#define NUM_TRIGGERS (HILDON_IM_TRIGGER_UNKNOWN - HILDON_IM_TRIGGER_NONE + 1)
+#define TRIGGER_SLOT(trigger) ((trigger) - HILDON_IM_TRIGGER_NONE)
+
+#define TRIGGER_TYPE_KEY(trigger, type) \
+  GUINT_TO_POINTER ((((guint) (trigger) & 0xffff) << 16) | \
+                    ((guint) (type) & 0xffff))
+
+/* Mirror of the GConf keys we read, see settings_load() */
+typedef struct {
+  gint      current_language;
+  gchar    *languages[NUM_LANGUAGES];
+  gboolean  use_finger_kb;
+  gchar    *hkb_plugin;
+  gchar    *finger_plugin;
+  gchar    *stylus_plugin;
+  gboolean  ext_kb_long_press_disabled;
+  gint      ext_kb_long_press_timeout;
+  gint      widget_pool_size;
+  gint      widget_pool_budget;
+  gint      plugin_unload_delay;    /* -1 if unset */
+} Settings;
 
 typedef GtkWidget *(*im_init_func)(HildonIMUI *);
 typedef const HildonIMPluginInfo *(*im_info_func)(void);
@@ -148,11 +214,12 @@ struct _HildonIMUIPrivate
   HildonIMOptionMask options;
   HildonIMTrigger trigger;
 
-  gchar *surrounding;
+  /* Reassembled from chunks, see reassemble_chunk() */
+  GString *surrounding;
   gint surrounding_offset;
   HildonIMCommitMode commit_mode;
   
-  gchar *committed_preedit;
+  GString *committed_preedit;
 
   guint sound_timeout_id;
 
@@ -168,7 +235,48 @@ struct _HildonIMUIPrivate
   gboolean return_key_pressed;
   gboolean use_finger_kb;
 
+  HildonIMCache *cache;
+  gboolean cache_stale;
+  GPid recache_pid;
+  GFileMonitor *cache_monitor;
+  guint cache_reload_id;
+  guint prewarm_id;
+  guint prewarm_next;
   GSList *all_methods;
+  /* Hidden widgets of flushed plugins, most recently used first */
+  GQueue *widget_pool;
+  gsize widget_pool_bytes;
+  gint widget_pool_size;        /* max widgets, 0 disables the pool */
+  gint widget_pool_budget;      /* max approximate size, in KiB */
+  gboolean memory_low;
+  guint activation_serial;      /* bumped by every activate_plugin() */
+  gboolean activating;          /* a widget is created for activation */
+  gboolean language_pending;    /* language change waiting for it */
+  gint64 show_requested;        /* monotonic time of an unmapped show */
+  gboolean key_latency;         /* see METRICS_KEY_LATENCY_ENV */
+  /* Key presses held down without a commit yet, oldest first */
+  PendingKeyPress key_presses[KEY_LATENCY_SLOTS];
+  guint n_key_presses;
+  guint flush_id;               /* see flush_sent_events() */
+  Window bulk_window;           /* last asked for bulk text support */
+  gboolean bulk_text;           /* bulk_window takes bulk transfers */
+  guint bulk_slot;              /* next HILDON_IM_BULK_TEXT_PROPERTY */
+  /* PluginData with a widget in use, per HildonIMPluginInterest. Rebuilt
+   * on dispatch after invalidate_subscribers() */
+  GPtrArray *key_event_subscribers;
+  GPtrArray *settings_subscribers;
+  gboolean subscribers_dirty;
+
+  /* SettingsHandler lists by key quark, and by id */
+  GHashTable *settings_handlers;
+  GHashTable *settings_handler_ids;
+  guint last_settings_handler_id;
+  /* Notifications coalesced until dispatch_settings() */
+  GHashTable *pending_settings;
+  GSList *pending_keys;
+  guint settings_idle_id;
+  Settings settings;
+  PluginRegistry registry;
   GtkBox *im_box;
   gboolean has_special;
 
@@ -179,6 +287,7 @@ struct _HildonIMUIPrivate
 
   gboolean plugins_available;
   GSList   *last_plugins;
+  GHashTable *last_by_trigger_type;
   PluginData *current_plugin;
 
   GtkWidget *menu_plugin_list;
@@ -191,9 +300,8 @@ struct _HildonIMUIPrivate
   gchar* cached_finger_plugin_name;
   gchar* cached_stylus_plugin_name;
 
-  PluginData *default_hkb_plugin;
-  PluginData *default_finger_plugin;
-  PluginData *default_stylus_plugin;
+  /* Resolved from the cached_*_plugin_name, see update_default_plugins */
+  PluginData *default_plugins[NUM_TRIGGERS];
 
   gboolean ext_kb_long_press_disabled;
   guint16  ext_kb_long_press_timeout;
@@ -214,9 +322,12 @@ static void hildon_im_ui_class_init(HildonIMUIClass *klass);
 
 static void hildon_im_ui_send_event(HildonIMUI *self,
                                           Window window, XEvent *event);
+static int hildon_im_ui_x_error_handler(Display *dpy, XErrorEvent *error);
 
 static gboolean hildon_im_ui_restore_previous_mode_real(HildonIMUI *self);
 static void flush_plugins(HildonIMUI *, PluginData *, gboolean);
+static gboolean hildon_im_ui_hide(gpointer data);
+static void schedule_prewarm (HildonIMUI *self);
 static void hildon_im_hw_cb(osso_hw_state_t*, gpointer);
 
 static void detect_first_boot (HildonIMUI *self);
@@ -232,47 +343,100 @@ static unsigned long get_window_pid (Window window);
 
 G_DEFINE_TYPE_WITH_CODE(HildonIMUI, hildon_im_ui, GTK_TYPE_WINDOW, G_ADD_PRIVATE(HildonIMUI))
 
-static gint
-_plugin_by_trigger_type (gconstpointer a, gconstpointer b)
+/* Serials of the XSendEvent requests that may still fail, ascending */
+static GArray *sent_serials = NULL;
+static XErrorHandler chained_error_handler = NULL;
+
+static guint
+plugin_name_hash (gconstpointer key)
 {
-  TriggerType *tt = (TriggerType*) b;
-  gint trigger_a, type_a;
-  
-  if (a == NULL || 
-      ((PluginData*) a)->info == NULL ||
-      tt == NULL)
-    return -1;
+  const gchar *p;
+  guint hash = 5381;
 
-  trigger_a = ((PluginData *) a)->info->trigger;
-  type_a = ((PluginData *) a)->info->type;
+  for (p = key; *p != '\0'; p++)
+    hash = (hash << 5) + hash + g_ascii_tolower (*p);
 
-  /* Only compare the trigger */
-  if (tt->type == -1 &&
-      trigger_a == tt->trigger)
-    return 0;
+  return hash;
+}
 
-  /* Only compare the type */
-  if (tt->trigger == -1 &&
-      type_a == tt->type)
-    return 0;
+static gboolean
+plugin_name_equal (gconstpointer a, gconstpointer b)
+{
+  return g_ascii_strcasecmp (a, b) == 0;
+}
 
-  if (trigger_a == tt->trigger &&
-      type_a == tt->type)
-    return 0;
+/* Makes plugin the match for its (trigger, type) and the two wildcard
+ * keys. With replace FALSE an earlier match is kept. */
+static void
+trigger_type_index_add (GHashTable *index, PluginData *plugin,
+                        gboolean replace)
+{
+  gpointer keys[3];
+  guint i;
 
-  return -1;
+  keys[0] = TRIGGER_TYPE_KEY (plugin->info->trigger, plugin->info->type);
+  keys[1] = TRIGGER_TYPE_KEY (plugin->info->trigger, -1);
+  keys[2] = TRIGGER_TYPE_KEY (-1, plugin->info->type);
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+  {
+    if (replace || g_hash_table_lookup (index, keys[i]) == NULL)
+      g_hash_table_insert (index, keys[i], plugin);
+  }
 }
 
-static gint
-_plugin_by_name (gconstpointer a, gconstpointer b)
+/* The first plugin of methods wins, like with g_slist_find_custom() */
+static GHashTable *
+trigger_type_index_new (GSList *methods)
 {
-  if (a == NULL || 
-      ((PluginData*) a)->info == NULL ||
-      b == NULL)
-    return -1;
+  GHashTable *index;
 
-  return g_ascii_strcasecmp (((PluginData*) a)->info->name,
-      (gchar *) b);
+  index = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (; methods != NULL; methods = methods->next)
+  {
+    PluginData *plugin = (PluginData *) methods->data;
+
+    if (plugin->info != NULL)
+      trigger_type_index_add (index, plugin, FALSE);
+  }
+
+  return index;
+}
+
+static void
+plugin_registry_build (PluginRegistry *registry, GSList *methods)
+{
+  GSList *iter;
+
+  registry->by_name = g_hash_table_new (plugin_name_hash, plugin_name_equal);
+  registry->by_filename = g_hash_table_new (g_str_hash, g_str_equal);
+  for (iter = methods; iter != NULL; iter = iter->next)
+  {
+    PluginData *plugin = (PluginData *) iter->data;
+
+    if (plugin->info != NULL && plugin->info->name != NULL &&
+        g_hash_table_lookup (registry->by_name, plugin->info->name) == NULL)
+      g_hash_table_insert (registry->by_name, plugin->info->name, plugin);
+    if (g_hash_table_lookup (registry->by_filename, plugin->filename) == NULL)
+      g_hash_table_insert (registry->by_filename, plugin->filename, plugin);
+  }
+
+  registry->by_trigger_type = trigger_type_index_new (methods);
+}
+
+static void
+plugin_registry_clear (PluginRegistry *registry)
+{
+  if (registry->by_name != NULL)
+    g_hash_table_destroy (registry->by_name);
+  if (registry->by_filename != NULL)
+    g_hash_table_destroy (registry->by_filename);
+  if (registry->by_trigger_type != NULL)
+    g_hash_table_destroy (registry->by_trigger_type);
+
+  registry->by_name = NULL;
+  registry->by_filename = NULL;
+  registry->by_trigger_type = NULL;
 }
 
 static PluginData *
@@ -280,22 +444,11 @@ find_plugin_by_trigger_type (HildonIMUI *self,
                              HildonIMTrigger trigger,
                              gint type)
 {
-  GSList *found;
-  TriggerType tt;
-  
-  /* TODO use the default plugins */
-
-  tt.trigger = trigger;
-  tt.type = type;
-  found = g_slist_find_custom (self->priv->all_methods, 
-                               &tt,
-                               _plugin_by_trigger_type);
-  if (found)
-  {
-    return found->data;
-  }
+  if (self->priv->registry.by_trigger_type == NULL)
+    return NULL;
 
-  return NULL;
+  return g_hash_table_lookup (self->priv->registry.by_trigger_type,
+                              TRIGGER_TYPE_KEY (trigger, type));
 }
 
 static PluginData *
@@ -303,39 +456,26 @@ last_plugin_by_trigger_type (HildonIMUI *self,
                              HildonIMTrigger trigger,
                              gint type)
 {
-  GSList *found;
-  TriggerType tt;
+  if (self->priv->last_by_trigger_type == NULL)
+    return NULL;
 
-  tt.trigger = trigger;
-  tt.type = type;
-  found = g_slist_find_custom (self->priv->last_plugins, 
-                               &tt,
-                               _plugin_by_trigger_type);
-  if (found)
-  {
-    return found->data;
-  }
-
-  return NULL;
+  return g_hash_table_lookup (self->priv->last_by_trigger_type,
+                              TRIGGER_TYPE_KEY (trigger, type));
 }
 
 
 static PluginData *
 find_plugin_by_name (HildonIMUI *self, const gchar *name)
 {
-  GSList *found;
-  found = g_slist_find_custom (self->priv->all_methods, name, 
-      _plugin_by_name);
-
-  if (found)
-    return (PluginData*) found->data;
+  if (self->priv->registry.by_name == NULL || name == NULL)
+    return NULL;
 
-  return NULL;
+  return g_hash_table_lookup (self->priv->registry.by_name, name);
 }
 
 static PluginData *
-get_default_plugin_by_trigger (HildonIMUI *self,
-                               HildonIMTrigger trigger)
+resolve_default_plugin (HildonIMUI *self,
+                        HildonIMTrigger trigger)
 {
   PluginData *plugin = NULL;
   gchar *plugin_name;
@@ -366,43 +506,222 @@ get_default_plugin_by_trigger (HildonIMUI *self,
   return plugin;
 }
 
+/* Has to be called whenever the plugin list or one of the
+ * GCONF_IM_*_PLUGIN keys changes */
+static void
+update_default_plugins (HildonIMUI *self)
+{
+  gint trigger;
+
+  for (trigger = HILDON_IM_TRIGGER_NONE;
+       trigger <= HILDON_IM_TRIGGER_UNKNOWN;
+       trigger++)
+  {
+    self->priv->default_plugins[TRIGGER_SLOT (trigger)] =
+      resolve_default_plugin (self, trigger);
+  }
+}
+
+static PluginData *
+get_default_plugin_by_trigger (HildonIMUI *self,
+                               HildonIMTrigger trigger)
+{
+  if (trigger < HILDON_IM_TRIGGER_NONE || trigger > HILDON_IM_TRIGGER_UNKNOWN)
+    return NULL;
+
+  return self->priv->default_plugins[TRIGGER_SLOT (trigger)];
+}
+
 static void
 update_last_plugins (HildonIMUI *self, PluginData *plugin)
 {
-  GSList *found;
-  TriggerType tt;
+  PluginData *found;
 
   g_return_if_fail (self != NULL);
   g_return_if_fail (plugin != NULL && plugin->info != NULL);
 
-  tt.trigger = plugin->info->trigger;
-  tt.type = plugin->info->type;
+  if (self->priv->last_by_trigger_type == NULL)
+    self->priv->last_by_trigger_type = trigger_type_index_new (NULL);
+
+  found = g_hash_table_lookup (self->priv->last_by_trigger_type,
+      TRIGGER_TYPE_KEY (plugin->info->trigger, plugin->info->type));
+  if (found != NULL && found != plugin)
+    g_warning ("Replacing for %d %d", plugin->info->trigger,
+               plugin->info->type);
+  if (found != NULL)
+    self->priv->last_plugins = g_slist_remove (self->priv->last_plugins,
+                                               found);
 
-  found = g_slist_find_custom (self->priv->last_plugins, 
-      &tt,
-      _plugin_by_trigger_type);
-  if (found)
-  {
-    if (found->data != plugin) {
-      g_warning ("Replacing for %d %d", tt.trigger, tt.type);
-      self->priv->last_plugins = g_slist_delete_link (
-          self->priv->last_plugins, 
-          found);   
-    }
-  }
   self->priv->last_plugins = g_slist_prepend (self->priv->last_plugins,
       plugin);
+  trigger_type_index_add (self->priv->last_by_trigger_type, plugin, TRUE);
 
   return;
 }
 
+/* Rough memory footprint of a plugin widget: the module mapped for it,
+ * plus its window area at 32 bits per pixel */
+static gsize
+estimate_widget_cost (PluginData *plugin)
+{
+  GtkAllocation *allocation = &plugin->widget->allocation;
+  gsize cost = (gsize) plugin->file_size;
+
+  if (allocation->width > 1 && allocation->height > 1)
+    cost += (gsize) allocation->width * allocation->height * 4;
+
+  return cost;
+}
+
+/* To be called whenever a plugin gets or loses its widget */
+static void
+invalidate_subscribers (HildonIMUI *self)
+{
+  self->priv->subscribers_dirty = TRUE;
+}
+
+static void
+update_subscribers (HildonIMUI *self)
+{
+  HildonIMUIPrivate *priv = self->priv;
+  GSList *iter;
+
+  if (!priv->subscribers_dirty)
+    return;
+
+  g_ptr_array_set_size (priv->key_event_subscribers, 0);
+  g_ptr_array_set_size (priv->settings_subscribers, 0);
+
+  for (iter = priv->all_methods; iter != NULL; iter = iter->next)
+  {
+    PluginData *plugin = (PluginData *) iter->data;
+    HildonIMPluginInterest interests;
+
+    if (plugin->widget == NULL)
+      continue;
+
+    /* Pooled and pre-warmed widgets are hidden and disabled. The current
+     * plugin is disabled too while the UI is hidden, but still takes the
+     * hardware keys */
+    if (plugin->pool_link != NULL ||
+        (!plugin->enabled && plugin != priv->current_plugin))
+      continue;
+
+    interests = hildon_im_plugin_get_interests (HILDON_IM_PLUGIN (plugin->widget),
+                                                &plugin->settings_prefixes);
+    if (interests & HILDON_IM_INTEREST_KEY_EVENT)
+      g_ptr_array_add (priv->key_event_subscribers, plugin);
+    if (interests & HILDON_IM_INTEREST_SETTINGS_CHANGED)
+      g_ptr_array_add (priv->settings_subscribers, plugin);
+  }
+
+  priv->subscribers_dirty = FALSE;
+}
+
+static gboolean
+plugin_wants_setting (PluginData *plugin, const gchar *key)
+{
+  const gchar * const *prefix;
+
+  if (plugin->settings_prefixes == NULL)
+    return TRUE;
+
+  for (prefix = plugin->settings_prefixes; *prefix != NULL; prefix++)
+  {
+    if (g_str_has_prefix (key, *prefix))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+widget_pool_remove (HildonIMUI *self, PluginData *plugin)
+{
+  if (plugin->pool_link == NULL)
+    return;
+
+  g_queue_delete_link (self->priv->widget_pool, plugin->pool_link);
+  self->priv->widget_pool_bytes -= plugin->pool_cost;
+  plugin->pool_link = NULL;
+  plugin->pool_cost = 0;
+  invalidate_subscribers (self);
+}
+
+static void
+destroy_plugin_widget (HildonIMUI *self, PluginData *plugin)
+{
+  widget_pool_remove (self, plugin);
+
+  hildon_im_plugin_disable (HILDON_IM_PLUGIN (plugin->widget));
+  plugin->enabled = FALSE;
+
+  gtk_widget_destroy (plugin->widget);
+  plugin->widget = NULL;
+  invalidate_subscribers (self);
+}
+
+/* Destroys the least recently used widgets until the pool fits in
+ * its limits */
+static void
+widget_pool_trim (HildonIMUI *self)
+{
+  HildonIMUIPrivate *priv = self->priv;
+  gsize budget = (gsize) MAX (priv->widget_pool_budget, 0) * 1024;
+
+  while (!g_queue_is_empty (priv->widget_pool) &&
+         (g_queue_get_length (priv->widget_pool) >
+            (guint) MAX (priv->widget_pool_size, 0) ||
+          priv->widget_pool_bytes > budget))
+  {
+    destroy_plugin_widget (self, g_queue_peek_tail (priv->widget_pool));
+  }
+}
+
+/* Hides the widget of a flushed plugin and keeps it for reuse, instead
+ * of destroying it */
+static void
+widget_pool_add (HildonIMUI *self, PluginData *plugin)
+{
+  if (plugin->pool_link != NULL)
+    return;
+
+  if (plugin->enabled)
+  {
+    hildon_im_plugin_disable (HILDON_IM_PLUGIN (plugin->widget));
+    plugin->enabled = FALSE;
+  }
+  gtk_widget_hide (plugin->widget);
+
+  g_queue_push_head (self->priv->widget_pool, plugin);
+  plugin->pool_link = g_queue_peek_head_link (self->priv->widget_pool);
+  plugin->pool_cost = estimate_widget_cost (plugin);
+  self->priv->widget_pool_bytes += plugin->pool_cost;
+  invalidate_subscribers (self);
+}
+
+/* Keeps the widget of a plugin that is not used any more around for a
+ * quick switch back, within the pool limits. The caller trims the pool. */
+static void
+park_plugin_widget (HildonIMUI *self, PluginData *plugin)
+{
+  if (self->priv->widget_pool_size > 0 && !self->priv->memory_low)
+    widget_pool_add (self, plugin);
+  else
+    destroy_plugin_widget (self, plugin);
+}
+
 /* This two functions don't activate the current plugin, just set
  * the current_plugin */
 static void
 set_current_plugin (HildonIMUI *self, PluginData *plugin)
 {
+  if (plugin != NULL)
+    widget_pool_remove (self, plugin);
+
   self->priv->current_plugin = plugin;
   update_last_plugins (self, plugin);
+  invalidate_subscribers (self);
 }
 
 static GSList *
@@ -434,12 +753,14 @@ init_persistent_plugins(HildonIMUI *self)
   {
     PluginData *plugin = (PluginData *) iter->data;
 
-    if (plugin->info->type == HILDON_IM_TYPE_PERSISTENT)
+    if (plugin->info->type == HILDON_IM_TYPE_PERSISTENT &&
+        plugin->widget == NULL)
     {
       plugin->widget =
         GTK_WIDGET(hildon_im_plugin_create(self, plugin->filename));
       hildon_im_plugin_enable(HILDON_IM_PLUGIN(plugin->widget), TRUE);
       plugin->enabled = TRUE;
+      invalidate_subscribers (self);
     }
   }
 }
@@ -447,65 +768,201 @@ init_persistent_plugins(HildonIMUI *self)
 static void
 cleanup_plugins (HildonIMUI *self)
 {
-  GSList *iter;
-  PluginData *plugin;
-  if (self->priv->all_methods == NULL)
+  if (self->priv->cache == NULL)
     return;
 
-  iter = self->priv->all_methods;
   flush_plugins(self, NULL, TRUE);
-  while (iter)
+  g_queue_clear (self->priv->widget_pool);
+  self->priv->widget_pool_bytes = 0;
+
+  /* The plugin data points into the cache, which goes away with it */
+  g_slist_foreach (self->priv->all_methods, (GFunc) g_free, NULL);
+  g_slist_free (self->priv->all_methods);
+  self->priv->all_methods = NULL;
+  plugin_registry_clear (&self->priv->registry);
+  invalidate_subscribers (self);
+  memset (self->priv->default_plugins, 0,
+          sizeof (self->priv->default_plugins));
+
+  g_slist_free (self->priv->last_plugins);
+  self->priv->last_plugins = NULL;
+  if (self->priv->last_by_trigger_type != NULL)
   {
-    plugin = (PluginData *) iter->data;
-    if (plugin != NULL)
-    {
-      FREE_IF_SET (plugin->filename);
-      free_language_list (plugin->languages);
-      free_iminfo (plugin->info);
-    }
-    iter = g_slist_next (iter);
+    g_hash_table_destroy (self->priv->last_by_trigger_type);
+    self->priv->last_by_trigger_type = NULL;
   }
-  return;
+  self->priv->current_plugin = NULL;
+
+  cache_close (self->priv->cache);
+  self->priv->cache = NULL;
+}
+
+/* Creates the PluginData for the records of cache. The list points into
+ * the cache, so it must not outlive it. */
+static GSList *
+create_plugin_list (HildonIMCache *cache, gboolean stale,
+                    GSList **merged_languages)
+{
+  GSList *methods = NULL;
+  guint i;
+
+  for (i = 0; i < cache->num_plugins; i ++)
+  {
+    HildonIMCachePlugin *entry = &cache->plugins [i];
+    PluginData *plugin;
+
+    /* Until the cache is rebuilt, only offer plugins that are still there */
+    if (stale && !g_file_test (entry->filename, G_FILE_TEST_EXISTS))
+      continue;
+
+    plugin = (PluginData *) g_malloc0 (sizeof (PluginData));
+    plugin->filename = entry->filename;
+    plugin->languages = entry->languages;
+    plugin->info = &entry->info;
+    plugin->file_size = entry->size;
+    plugin->enabled = FALSE;
+    *merged_languages = merge_languages (*merged_languages,
+        plugin->languages);
+
+    methods = g_slist_prepend (methods, plugin);      
+  }
+
+  return methods;
+}
+
+static PluginData *
+find_plugin_by_filename (PluginRegistry *registry, const gchar *filename)
+{
+  if (registry->by_filename == NULL)
+    return NULL;
+
+  return g_hash_table_lookup (registry->by_filename, filename);
 }
 
 static gboolean
 init_plugins (HildonIMUI *self)
 {
-  FILE *f;
+  HildonIMCache *cache;
+  GSList *merged_languages = NULL;
+
+  cleanup_plugins (self);
+
+  cache = cache_open ();
+  self->priv->cache_stale = cache_is_stale (cache);
+  if (cache == NULL)
+    return FALSE;
+
+  self->priv->all_methods = create_plugin_list (cache,
+      self->priv->cache_stale, &merged_languages);
+  plugin_registry_build (&self->priv->registry, self->priv->all_methods);
+  update_default_plugins (self);
+  self->priv->cache = cache;
+
+  hildon_im_populate_available_languages (merged_languages);
+  free_language_list (merged_languages);
+
+  return TRUE;
+}
+
+/* Replaces the plugin list with the one of a freshly opened cache. The
+ * widgets of plugins that are still in the cache move over to the new
+ * PluginData, the others are destroyed. */
+static gboolean
+swap_plugins (HildonIMUI *self)
+{
+  HildonIMCache *cache;
+  GSList *methods, *iter, *last_plugins = NULL;
+  GSList *merged_languages = NULL;
+  PluginRegistry registry;
+  GQueue *pool;
+  PluginData *current = NULL;
+  gboolean stale;
+
+  cache = cache_open ();
+  if (cache == NULL)
+    return FALSE;
 
-  if (self->priv->all_methods != NULL)
-    cleanup_plugins (self);
+  stale = cache_is_stale (cache);
+  methods = create_plugin_list (cache, stale, &merged_languages);
+  plugin_registry_build (&registry, methods);
 
-  f = init_cache ();
-  if (f)
+  for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
   {
-    gint number_of_plugins;
-    gint i;
-    GSList *merged_languages = NULL;
-    HildonIMPluginInfo *info;
-    PluginData *plugin;
+    PluginData *old = (PluginData *) iter->data;
+    PluginData *new = find_plugin_by_filename (&registry, old->filename);
 
-    number_of_plugins = cache_get_number_of_plugins (f);
-    for (i = 0; i < number_of_plugins; i ++)
+    if (old == self->priv->current_plugin)
     {
-      plugin = (PluginData *) g_malloc0 (sizeof (PluginData));
-      plugin->filename = cache_get_soname (f);      
-      plugin->languages = cache_get_languages (f);
-      plugin->enabled = FALSE;
-      merged_languages = merge_languages (merged_languages,
-          plugin->languages);
-      info     = cache_get_iminfo (f);
+      if (new == NULL)
+        hildon_im_ui_hide (self);
+      current = new;
+    }
+
+    if (old->widget == NULL)
+      continue;
 
-      plugin->info = info;
-      self->priv->all_methods =
-        g_slist_prepend (self->priv->all_methods, plugin);      
+    if (new != NULL)
+    {
+      new->widget = old->widget;
+      new->enabled = old->enabled;
+      new->prewarmed = old->prewarmed;
+    }
+    else
+    {
+      hildon_im_plugin_disable (HILDON_IM_PLUGIN (old->widget));
+      gtk_widget_destroy (old->widget);
     }
+  }
 
-    hildon_im_populate_available_languages (merged_languages);
-    free_language_list (merged_languages);
-    fclose (f);
-  } else
-    return FALSE;
+  /* Carry the pool over in the same order, minus the removed plugins */
+  pool = g_queue_new ();
+  self->priv->widget_pool_bytes = 0;
+  while (!g_queue_is_empty (self->priv->widget_pool))
+  {
+    PluginData *old = g_queue_pop_head (self->priv->widget_pool);
+    PluginData *new = find_plugin_by_filename (&registry, old->filename);
+
+    if (new == NULL)
+      continue;
+
+    g_queue_push_tail (pool, new);
+    new->pool_link = g_queue_peek_tail_link (pool);
+    new->pool_cost = old->pool_cost;
+    self->priv->widget_pool_bytes += new->pool_cost;
+  }
+  g_queue_free (self->priv->widget_pool);
+  self->priv->widget_pool = pool;
+
+  for (iter = self->priv->last_plugins; iter != NULL; iter = iter->next)
+  {
+    PluginData *new = find_plugin_by_filename (&registry,
+        ((PluginData *) iter->data)->filename);
+
+    if (new != NULL)
+      last_plugins = g_slist_prepend (last_plugins, new);
+  }
+
+  g_slist_foreach (self->priv->all_methods, (GFunc) g_free, NULL);
+  g_slist_free (self->priv->all_methods);
+  g_slist_free (self->priv->last_plugins);
+  plugin_registry_clear (&self->priv->registry);
+  if (self->priv->last_by_trigger_type != NULL)
+    g_hash_table_destroy (self->priv->last_by_trigger_type);
+  cache_close (self->priv->cache);
+
+  self->priv->all_methods = methods;
+  self->priv->registry = registry;
+  self->priv->last_plugins = g_slist_reverse (last_plugins);
+  self->priv->last_by_trigger_type =
+    trigger_type_index_new (self->priv->last_plugins);
+  update_default_plugins (self);
+  self->priv->current_plugin = current;
+  self->priv->cache = cache;
+  self->priv->cache_stale = stale;
+  invalidate_subscribers (self);
+
+  hildon_im_populate_available_languages (merged_languages);
+  free_language_list (merged_languages);
 
   return TRUE;
 }
@@ -513,13 +970,274 @@ init_plugins (HildonIMUI *self)
 void
 hildon_im_reload_plugins (HildonIMUI *self)
 {
-  self->priv->plugins_available = init_plugins (self);
-  if (self->priv->plugins_available == FALSE)
+  if (swap_plugins (self))
   {
+    self->priv->plugins_available = TRUE;
+  }
+  else if (self->priv->cache == NULL)
+  {
+    self->priv->plugins_available = FALSE;
     g_warning ("Failed loading the plugins.");
     g_warning ("No IM will show.");
     return;
   }
+  else
+  {
+    g_warning ("Unable to reload the plugins, keeping the old ones");
+  }
+
+  init_persistent_plugins (self);
+  schedule_prewarm (self);
+}
+
+static void
+recache_done (GPid pid, gint status, gpointer data)
+{
+  HildonIMUI *self = HILDON_IM_UI (data);
+
+  g_spawn_close_pid (pid);
+  self->priv->recache_pid = 0;
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+  {
+    g_warning ("Rebuilding the plugin cache failed");
+    return;
+  }
+
+  /* The monitor picks up the new file by itself */
+  if (self->priv->cache_monitor == NULL)
+  {
+    g_message ("Plugin cache rebuilt, reloading the plugins");
+    hildon_im_reload_plugins (self);
+  }
+}
+
+/* Runs hildon-im-recache in the background if the cache is missing or out
+ * of date. The current records are served until it is done. The cache is
+ * normally owned by root and rebuilt by the package trigger, so this only
+ * works when the daemon may write the plugin directory. */
+static void
+check_plugin_cache (HildonIMUI *self)
+{
+  gchar *argv[] = { RECACHE_PATH, NULL };
+  GError *error = NULL;
+  gchar *directory;
+
+  if (!self->priv->cache_stale || self->priv->recache_pid != 0)
+    return;
+
+  directory = get_cache_file (CACHE_DIRECTORY);
+  if (access (directory, W_OK) != 0)
+  {
+    g_warning ("Plugin cache is out of date, but %s is not writable by "
+               "this user. Run %s as root to rebuild it",
+               directory, RECACHE_PATH);
+    g_free (directory);
+    return;
+  }
+  g_free (directory);
+
+  g_message ("Plugin cache is out of date, rebuilding it");
+
+  if (!g_spawn_async (NULL, argv, NULL,
+                      G_SPAWN_DO_NOT_REAP_CHILD |
+                      G_SPAWN_STDOUT_TO_DEV_NULL,
+                      NULL, NULL, &self->priv->recache_pid, &error))
+  {
+    g_warning ("Unable to run %s: %s", RECACHE_PATH, error->message);
+    g_error_free (error);
+    self->priv->recache_pid = 0;
+    return;
+  }
+
+  g_child_watch_add (self->priv->recache_pid, recache_done, self);
+}
+
+static gboolean
+cache_reload_timeout (gpointer data)
+{
+  HildonIMUI *self = HILDON_IM_UI (data);
+
+  self->priv->cache_reload_id = 0;
+  g_message ("Plugin cache changed, reloading the plugins");
+  hildon_im_reload_plugins (self);
+
+  return FALSE;
+}
+
+static void
+cache_changed (GFileMonitor *monitor, GFile *file, GFile *other_file,
+               GFileMonitorEvent event_type, gpointer data)
+{
+  HildonIMUI *self = HILDON_IM_UI (data);
+
+  /* A removed cache is not a reason to drop the plugins we have */
+  if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+      event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event_type != G_FILE_MONITOR_EVENT_CREATED)
+    return;
+
+  if (self->priv->cache_reload_id != 0)
+    g_source_remove (self->priv->cache_reload_id);
+
+  self->priv->cache_reload_id = g_timeout_add (CACHE_RELOAD_DELAY,
+                                               cache_reload_timeout, self);
+}
+
+static const HildonIMTrigger prewarm_triggers[] =
+{
+  HILDON_IM_TRIGGER_FINGER,
+  HILDON_IM_TRIGGER_KEYBOARD
+};
+
+/* Creates the default plugins one per idle call, so that the first show
+ * only has to enable them */
+static gboolean
+prewarm_plugins (gpointer data)
+{
+  HildonIMUI *self = HILDON_IM_UI (data);
+  PluginData *plugin;
+  HildonIMTrigger trigger;
+
+  trigger = prewarm_triggers[self->priv->prewarm_next++];
+  plugin = get_default_plugin_by_trigger (self, trigger);
+
+  if (plugin != NULL && plugin->widget == NULL)
+  {
+    plugin->widget = GTK_WIDGET (hildon_im_plugin_create (self,
+                                                          plugin->filename));
+    if (plugin->widget != NULL)
+    {
+      plugin->enabled = FALSE;
+      plugin->prewarmed = TRUE;
+      invalidate_subscribers (self);
+    }
+    else
+    {
+      g_warning ("Unable to pre-warm %s", plugin->info->name);
+    }
+  }
+
+  if (self->priv->prewarm_next < G_N_ELEMENTS (prewarm_triggers))
+    return TRUE;
+
+  self->priv->prewarm_id = 0;
+  return FALSE;
+}
+
+static void
+schedule_prewarm (HildonIMUI *self)
+{
+  /* Wait for the memory pressure to end, see hildon_im_hw_cb() */
+  if (self->priv->memory_low)
+    return;
+
+  self->priv->prewarm_next = 0;
+  if (self->priv->prewarm_id == 0)
+    self->priv->prewarm_id = g_idle_add_full (G_PRIORITY_LOW, prewarm_plugins,
+                                              self, NULL);
+}
+
+static void
+watch_plugin_cache (HildonIMUI *self)
+{
+  GError *error = NULL;
+  gchar *filename;
+  GFile *file;
+
+  filename = get_cache_file (CACHE_FILENAME);
+  file = g_file_new_for_path (filename);
+  g_free (filename);
+
+  self->priv->cache_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE,
+                                                   NULL, &error);
+  g_object_unref (file);
+
+  if (self->priv->cache_monitor == NULL)
+  {
+    g_warning ("Unable to watch the plugin cache: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  g_signal_connect (self->priv->cache_monitor, "changed",
+                    G_CALLBACK (cache_changed), self);
+}
+
+/* Gives back the slack of a buffer */
+static void
+shrink_string (GString **string)
+{
+  GString *shrunk;
+
+  if ((*string)->allocated_len > (*string)->len + 1)
+  {
+    shrunk = g_string_new_len ((*string)->str, (*string)->len);
+    g_string_free (*string, TRUE);
+    *string = shrunk;
+  }
+}
+
+/* Gives back whatever can be rebuilt later: the plugin caches, the widgets
+ * that are not on screen, the modules left without instances and the
+ * slack of our own buffers, including the surrounding text and committed
+ * preedit that are now reassembled in growing GStrings. The destroyed
+ * widgets are created again when activated. */
+static void
+release_memory (HildonIMUI *self)
+{
+  HildonIMUIPrivate *priv = self->priv;
+  GSList *iter;
+
+  if (priv->prewarm_id != 0)
+  {
+    g_source_remove (priv->prewarm_id);
+    priv->prewarm_id = 0;
+  }
+
+  for (iter = priv->all_methods; iter != NULL; iter = iter->next)
+  {
+    PluginData *plugin = (PluginData *) iter->data;
+
+    if (plugin->widget == NULL)
+      continue;
+
+    hildon_im_plugin_save_data (HILDON_IM_PLUGIN (plugin->widget));
+    hildon_im_plugin_memory_low (HILDON_IM_PLUGIN (plugin->widget));
+
+    if (plugin != priv->current_plugin &&
+        plugin->info->type != HILDON_IM_TYPE_PERSISTENT &&
+        !GTK_WIDGET_VISIBLE (plugin->widget))
+    {
+      plugin->prewarmed = FALSE;
+      destroy_plugin_widget (self, plugin);
+    }
+  }
+  hildon_im_plugin_unload_idle_modules ();
+
+  shrink_string (&priv->plugin_buffer);
+  shrink_string (&priv->surrounding);
+  shrink_string (&priv->committed_preedit);
+
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim (0);
+#endif
+}
+
+/* Follows the memory low indication of the device: releases what can be
+ * rebuilt when it is raised and lets the pre-warm run again when it is
+ * cleared. The rest comes back as it is used. */
+static void
+set_memory_low (HildonIMUI *self, gboolean memory_low)
+{
+  if (memory_low == self->priv->memory_low)
+    return;
+
+  self->priv->memory_low = memory_low;
+  if (memory_low)
+    release_memory (self);
+  else
+    schedule_prewarm (self);
 }
 
 /*
@@ -561,12 +1279,7 @@ hildon_im_hw_cb(osso_hw_state_t* state, gpointer data)
     }
   }
 
-  if (state->memory_low_ind)
-  {
-    /* TODO:
-     * - prevent new allocations (WC, language swithing)?
-     */
-  }
+  set_memory_low (self, state->memory_low_ind != FALSE);
   if (state->system_inactivity_ind)
   {
     /* TODO:
@@ -599,6 +1312,8 @@ hildon_im_ui_hide(gpointer data)
   }
 
   gtk_widget_hide(GTK_WIDGET(self));
+  self->priv->show_requested = 0;
+  self->priv->n_key_presses = 0;
 
   if (self->priv->current_plugin != NULL &&
       CURRENT_IM_WIDGET (self) != NULL)
@@ -612,21 +1327,9 @@ hildon_im_ui_hide(gpointer data)
 inline static PluginData *
 hildon_im_ui_get_plugin_info(HildonIMUI *self, gchar *name)
 {
-  GSList *iter;
-
   g_return_val_if_fail(HILDON_IM_IS_UI(self), NULL);
 
-  for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
-  {
-    PluginData *info;
-    info = (PluginData *) iter->data;
-    if (info->info != NULL && g_ascii_strcasecmp (info->info->name, name) == 0)
-    {
-      return info;
-    }
-  }
-
-  return NULL;
+  return find_plugin_by_name (self, name);
 }
 
 static void
@@ -636,6 +1339,9 @@ hildon_im_ui_show(HildonIMUI *self)
   
   g_return_if_fail(HILDON_IM_IS_UI(self));
 
+  if (!GTK_WIDGET_MAPPED(self) && self->priv->show_requested == 0)
+    self->priv->show_requested = g_get_monotonic_time ();
+
   if (self->priv->trigger == HILDON_IM_TRIGGER_UNKNOWN)
   {
     if (self->priv->keyboard_available && self->priv->use_finger_kb)
@@ -683,13 +1389,17 @@ hildon_im_ui_show(HildonIMUI *self)
         flush_plugins (self, NULL, FALSE);
       }
 
-      set_current_plugin (self, plugin);
-      if (!plugin->enabled)
+      /* Unless the flush evicted it from the widget pool */
+      if (plugin->widget != NULL)
       {
-        hildon_im_plugin_enable (HILDON_IM_PLUGIN(plugin->widget), FALSE);
-        plugin->enabled = TRUE;
+        set_current_plugin (self, plugin);
+        if (!plugin->enabled)
+        {
+          hildon_im_plugin_enable (HILDON_IM_PLUGIN(plugin->widget), FALSE);
+          plugin->enabled = TRUE;
+        }
+        return;
       }
-      return;
     } 
 
     activate_plugin(self, plugin, TRUE);
@@ -713,8 +1423,12 @@ hildon_im_ui_show(HildonIMUI *self)
   if (self->priv->current_plugin != NULL)
   {
     activate_plugin (self, self->priv->current_plugin, TRUE);
-    hildon_im_plugin_enable (HILDON_IM_PLUGIN(self->priv->current_plugin->widget), FALSE);
-    self->priv->current_plugin->enabled = TRUE;
+    /* Unless it is still being loaded */
+    if (self->priv->current_plugin->widget != NULL)
+    {
+      hildon_im_plugin_enable (HILDON_IM_PLUGIN(self->priv->current_plugin->widget), FALSE);
+      self->priv->current_plugin->enabled = TRUE;
+    }
   }
 }
 
@@ -729,8 +1443,13 @@ hildon_im_ui_activate_current_language(HildonIMUI *self)
     activate_plugin (self, self->priv->current_plugin,
                                      TRUE);
   }
- 
-  if (CURRENT_IM_WIDGET (self) != NULL)
+
+  /* The plugin being loaded gets it from finish_activation() */
+  if (self->priv->activating)
+  {
+    self->priv->language_pending = TRUE;
+  }
+  else if (CURRENT_IM_WIDGET (self) != NULL)
   {
     hildon_im_ui_foreach_plugin(self, hildon_im_plugin_language);
   }
@@ -801,150 +1520,389 @@ hildon_im_ui_set_keyboard_state(HildonIMUI *self,
   hildon_im_ui_foreach_plugin(self, hildon_im_plugin_keyboard_state_changed);
 }
 
-static void
-hildon_im_ui_gconf_change_callback(GConfClient* client,
-                                   guint cnxn_id,
-                                   GConfEntry *entry,
-                                   gpointer user_data)
+static const struct
 {
-  HildonIMUI *self;
-  GConfValue *value;
   const gchar *key;
-  GSList *iter;
+  GConfValueType type;
+  gsize offset;
+  gint unset;           /* value of int and bool fields without a key */
+} settings_fields[] =
+{
+  { GCONF_CURRENT_LANGUAGE, GCONF_VALUE_INT,
+    G_STRUCT_OFFSET (Settings, current_language), 0 },
+  { HILDON_IM_GCONF_PRIMARY_LANGUAGE, GCONF_VALUE_STRING,
+    G_STRUCT_OFFSET (Settings, languages[PRIMARY_LANGUAGE]), 0 },
+  { HILDON_IM_GCONF_SECONDARY_LANGUAGE, GCONF_VALUE_STRING,
+    G_STRUCT_OFFSET (Settings, languages[SECONDARY_LANGUAGE]), 0 },
+  { HILDON_IM_GCONF_USE_FINGER_KB, GCONF_VALUE_BOOL,
+    G_STRUCT_OFFSET (Settings, use_finger_kb), FALSE },
+  { GCONF_IM_HKB_PLUGIN, GCONF_VALUE_STRING,
+    G_STRUCT_OFFSET (Settings, hkb_plugin), 0 },
+  { GCONF_IM_FINGER_PLUGIN, GCONF_VALUE_STRING,
+    G_STRUCT_OFFSET (Settings, finger_plugin), 0 },
+  { GCONF_IM_STYLUS_PLUGIN, GCONF_VALUE_STRING,
+    G_STRUCT_OFFSET (Settings, stylus_plugin), 0 },
+  { GCONF_EXT_KB_LONG_PRESS_DISABLED, GCONF_VALUE_BOOL,
+    G_STRUCT_OFFSET (Settings, ext_kb_long_press_disabled), FALSE },
+  { GCONF_EXT_KB_LONG_PRESS_TIMEOUT, GCONF_VALUE_INT,
+    G_STRUCT_OFFSET (Settings, ext_kb_long_press_timeout), 0 },
+  { GCONF_WIDGET_POOL_SIZE, GCONF_VALUE_INT,
+    G_STRUCT_OFFSET (Settings, widget_pool_size), 0 },
+  { GCONF_WIDGET_POOL_BUDGET, GCONF_VALUE_INT,
+    G_STRUCT_OFFSET (Settings, widget_pool_budget), 0 },
+  { GCONF_PLUGIN_UNLOAD_DELAY, GCONF_VALUE_INT,
+    G_STRUCT_OFFSET (Settings, plugin_unload_delay), -1 }
+};
+
+/* The directories holding the keys of settings_fields */
+static const gchar *settings_dirs[] =
+{
+  HILDON_IM_GCONF_DIR,
+  HILDON_IM_GCONF_LANG_DIR,
+  GCONF_IM_DEFAULT_PLUGINS
+};
 
-  if ((value = gconf_entry_get_value(entry)) == NULL)
+/* Stores the value of key in its field, if we mirror it. Unset keys and
+ * values of the wrong type go back to the default. */
+static void
+settings_set (Settings *settings, const gchar *key, const GConfValue *value)
+{
+  static GHashTable *fields = NULL;
+  gpointer index;
+  guint i;
+
+  if (fields == NULL)
   {
+    fields = g_hash_table_new (NULL, NULL);
+    for (i = 0; i < G_N_ELEMENTS (settings_fields); i++)
+      g_hash_table_insert (fields,
+                           GUINT_TO_POINTER (g_quark_from_static_string (settings_fields[i].key)),
+                           GUINT_TO_POINTER (i + 1));
+  }
+
+  index = g_hash_table_lookup (fields,
+                               GUINT_TO_POINTER (g_quark_try_string (key)));
+  if (index == NULL)
     return;
+
+  i = GPOINTER_TO_UINT (index) - 1;
+  if (value != NULL && value->type != settings_fields[i].type)
+    value = NULL;
+
+  switch (settings_fields[i].type)
+  {
+    case GCONF_VALUE_INT:
+      G_STRUCT_MEMBER (gint, settings, settings_fields[i].offset) =
+        value != NULL ? gconf_value_get_int (value) : settings_fields[i].unset;
+      break;
+    case GCONF_VALUE_BOOL:
+      G_STRUCT_MEMBER (gboolean, settings, settings_fields[i].offset) =
+        value != NULL ? gconf_value_get_bool (value) : settings_fields[i].unset;
+      break;
+    case GCONF_VALUE_STRING:
+      g_free (G_STRUCT_MEMBER (gchar *, settings, settings_fields[i].offset));
+      G_STRUCT_MEMBER (gchar *, settings, settings_fields[i].offset) =
+        value != NULL ? g_strdup (gconf_value_get_string (value)) : NULL;
+      break;
+    default:
+      break;
   }
+}
 
-  self = HILDON_IM_UI(user_data);
-  key = gconf_entry_get_key(entry);
+static void
+settings_init (Settings *settings)
+{
+  guint i;
 
-  g_return_if_fail(HILDON_IM_IS_UI(self));
+  memset (settings, 0, sizeof (Settings));
+  for (i = 0; i < G_N_ELEMENTS (settings_fields); i++)
+    settings_set (settings, settings_fields[i].key, NULL);
+}
+
+static void
+settings_clear (Settings *settings)
+{
+  guint i;
 
-  if (strcmp(key, GCONF_CURRENT_LANGUAGE) == 0)
+  for (i = 0; i < G_N_ELEMENTS (settings_fields); i++)
   {
-    if (value->type == GCONF_VALUE_INT)
-    {
-      gint new_value;
-      new_value = gconf_value_get_int(value);
-      if (new_value != self->priv->current_language_index)
-      {
-        self->priv->current_language_index = new_value;
-        hildon_im_ui_activate_current_language(self);
-      }      
-    }
+    if (settings_fields[i].type == GCONF_VALUE_STRING)
+      g_free (G_STRUCT_MEMBER (gchar *, settings, settings_fields[i].offset));
   }
-  else if (strcmp(key, GCONF_INPUT_METHOD) == 0)
+  settings_init (settings);
+}
+
+/* Fills the snapshot with one listing per directory. The directories are
+ * preloaded in the client, see hildon_im_ui_init(), so this does not go
+ * back to the GConf daemon key by key. */
+static void
+settings_load (HildonIMUI *self)
+{
+  guint i;
+
+  settings_clear (&self->priv->settings);
+
+  for (i = 0; i < G_N_ELEMENTS (settings_dirs); i++)
   {
-    if (value->type == GCONF_VALUE_STRING)
+    GSList *entries, *iter;
+
+    entries = gconf_client_all_entries (self->client, settings_dirs[i], NULL);
+    for (iter = entries; iter != NULL; iter = iter->next)
     {
-      gchar *new_value;
+      GConfEntry *entry = (GConfEntry *) iter->data;
 
-      new_value = (gchar *)gconf_value_get_string (value);
-      hildon_im_ui_activate_plugin (self, new_value, TRUE);
+      settings_set (&self->priv->settings, gconf_entry_get_key (entry),
+                    gconf_entry_get_value (entry));
+      gconf_entry_free (entry);
     }
+    g_slist_free (entries);
   }
-  else if (strcmp(key, HILDON_IM_GCONF_PRIMARY_LANGUAGE) == 0)
+}
+
+typedef struct
+{
+  guint id;
+  GQuark key;
+  HildonIMUISettingsFunc func;
+  gpointer user_data;
+} SettingsHandler;
+
+static void
+current_language_changed (HildonIMUI *self, const gchar *key,
+                          const GConfValue *value, gpointer data)
+{
+  if (value->type == GCONF_VALUE_INT)
   {
-    if(value->type == GCONF_VALUE_STRING)
+    gint new_value;
+    new_value = gconf_value_get_int(value);
+    if (new_value != self->priv->current_language_index)
     {
-      const gchar *language = gconf_value_get_string(value);
-      GSList *iter;
+      self->priv->current_language_index = new_value;
+      hildon_im_ui_activate_current_language(self);
+    }      
+  }
+}
 
-      strncpy (self->priv->selected_languages [PRIMARY_LANGUAGE], language,
-          strlen (language) > BUFFER_SIZE ? BUFFER_SIZE -1: strlen (language));
+static void
+input_method_changed (HildonIMUI *self, const gchar *key,
+                      const GConfValue *value, gpointer data)
+{
+  if (value->type == GCONF_VALUE_STRING)
+  {
+    gchar *new_value;
 
-      for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
-      {
-        PluginData *info;
-        info = (PluginData *) iter->data;
-        if (info->widget != NULL)
-        {
-          hildon_im_plugin_language_settings_changed(
-                  HILDON_IM_PLUGIN(info->widget),
-                  PRIMARY_LANGUAGE);
-        }
-      }
-    }
+    new_value = (gchar *)gconf_value_get_string (value);
+    hildon_im_ui_activate_plugin (self, new_value, TRUE);
   }
-  else if (strcmp(key, HILDON_IM_GCONF_SECONDARY_LANGUAGE) == 0)
+}
+
+static void
+primary_language_changed (HildonIMUI *self, const gchar *key,
+                          const GConfValue *value, gpointer data)
+{
+  if(value->type == GCONF_VALUE_STRING)
   {
-    if (value->type == GCONF_VALUE_STRING)
-    {
-      gboolean lang_valid;
-      const gchar *language = gconf_value_get_string(value);
+    const gchar *language = gconf_value_get_string(value);
+    GSList *iter;
+
+    strncpy (self->priv->selected_languages [PRIMARY_LANGUAGE], language,
+        strlen (language) > BUFFER_SIZE ? BUFFER_SIZE -1: strlen (language));
 
-      lang_valid = !(language == NULL || language [0] == 0);
-      if (lang_valid)
-      {
-        strncpy (self->priv->selected_languages [SECONDARY_LANGUAGE], language,
-          strlen (language) > BUFFER_SIZE ? BUFFER_SIZE -1: strlen (language));
-      }
-      else
-      {
-        /* Secondary was set to empty */
-        if (self->priv->current_language_index != PRIMARY_LANGUAGE)
-        {
-          /* We have the secondary set as current - set to primary.
-           * Just set the gconf here, the others will propagate. */
-          gconf_client_set_int (self->client,
-                                GCONF_CURRENT_LANGUAGE, PRIMARY_LANGUAGE, NULL);
-        }
-        self->priv->selected_languages[SECONDARY_LANGUAGE][0] = 0;
-      }
-    }
     for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
     {
-      PluginData *info = (PluginData *) iter->data;
+      PluginData *info;
+      info = (PluginData *) iter->data;
       if (info->widget != NULL)
       {
         hildon_im_plugin_language_settings_changed(
                 HILDON_IM_PLUGIN(info->widget),
-                SECONDARY_LANGUAGE);
+                PRIMARY_LANGUAGE);
       }
     }
   }
-  else if (strcmp(key, HILDON_IM_GCONF_USE_FINGER_KB) == 0)
+}
+
+static void
+secondary_language_changed (HildonIMUI *self, const gchar *key,
+                            const GConfValue *value, gpointer data)
+{
+  GSList *iter;
+
+  if (value->type == GCONF_VALUE_STRING)
   {
-    if (value->type == GCONF_VALUE_BOOL)
+    gboolean lang_valid;
+    const gchar *language = gconf_value_get_string(value);
+
+    lang_valid = !(language == NULL || language [0] == 0);
+    if (lang_valid)
+    {
+      strncpy (self->priv->selected_languages [SECONDARY_LANGUAGE], language,
+        strlen (language) > BUFFER_SIZE ? BUFFER_SIZE -1: strlen (language));
+    }
+    else
     {
-      self->priv->use_finger_kb = gconf_value_get_bool(value);
+      /* Secondary was set to empty */
+      if (self->priv->current_language_index != PRIMARY_LANGUAGE)
+      {
+        /* We have the secondary set as current - set to primary.
+         * Just set the gconf here, the others will propagate. */
+        gconf_client_set_int (self->client,
+                              GCONF_CURRENT_LANGUAGE, PRIMARY_LANGUAGE, NULL);
+      }
+      self->priv->selected_languages[SECONDARY_LANGUAGE][0] = 0;
     }
   }
-  else if (strcmp(key, GCONF_IM_HKB_PLUGIN) == 0)
+  for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
   {
-    g_free(self->priv->cached_hkb_plugin_name);
-    self->priv->cached_hkb_plugin_name =
-      gconf_client_get_string (self->client, GCONF_IM_HKB_PLUGIN, NULL);
+    PluginData *info = (PluginData *) iter->data;
+    if (info->widget != NULL)
+    {
+      hildon_im_plugin_language_settings_changed(
+              HILDON_IM_PLUGIN(info->widget),
+              SECONDARY_LANGUAGE);
+    }
   }
-  else if (strcmp(key, GCONF_IM_FINGER_PLUGIN) == 0)
+}
+
+static void
+use_finger_kb_changed (HildonIMUI *self, const gchar *key,
+                       const GConfValue *value, gpointer data)
+{
+  if (value->type == GCONF_VALUE_BOOL)
   {
-    g_free(self->priv->cached_finger_plugin_name);
-    self->priv->cached_finger_plugin_name =
-      gconf_client_get_string (self->client, GCONF_IM_FINGER_PLUGIN, NULL);
+    self->priv->use_finger_kb = gconf_value_get_bool(value);
   }
-  else if (strcmp(key, GCONF_IM_STYLUS_PLUGIN) == 0)
+}
+
+static void
+default_plugin_changed (HildonIMUI *self, const gchar *key,
+                        const GConfValue *value, gpointer data)
+{
+  Settings *settings = &self->priv->settings;
+  gchar **name;
+  const gchar *new_name;
+
+  if (strcmp (key, GCONF_IM_HKB_PLUGIN) == 0)
   {
-    g_free(self->priv->cached_stylus_plugin_name);
-    self->priv->cached_stylus_plugin_name =
-      gconf_client_get_string (self->client, GCONF_IM_STYLUS_PLUGIN, NULL);
+    name = &self->priv->cached_hkb_plugin_name;
+    new_name = settings->hkb_plugin;
   }
-  else if (strcmp (key, GCONF_EXT_KB_LONG_PRESS_DISABLED) == 0)
+  else if (strcmp (key, GCONF_IM_FINGER_PLUGIN) == 0)
   {
-    self->priv->ext_kb_long_press_disabled = gconf_value_get_bool (value);
-    hildon_im_ui_send_long_press_settings (self);
+    name = &self->priv->cached_finger_plugin_name;
+    new_name = settings->finger_plugin;
   }
-  else if (strcmp (key, GCONF_EXT_KB_LONG_PRESS_TIMEOUT) == 0)
+  else
   {
+    name = &self->priv->cached_stylus_plugin_name;
+    new_name = settings->stylus_plugin;
+  }
+
+  g_free (*name);
+  *name = g_strdup (new_name);
+  update_default_plugins (self);
+}
+
+static void
+long_press_changed (HildonIMUI *self, const gchar *key,
+                    const GConfValue *value, gpointer data)
+{
+  if (strcmp (key, GCONF_EXT_KB_LONG_PRESS_DISABLED) == 0)
+    self->priv->ext_kb_long_press_disabled = gconf_value_get_bool (value);
+  else
     self->priv->ext_kb_long_press_timeout = gconf_value_get_int (value);
-    hildon_im_ui_send_long_press_settings (self);
+
+  hildon_im_ui_send_long_press_settings (self);
+}
+
+static void
+widget_pool_changed (HildonIMUI *self, const gchar *key,
+                     const GConfValue *value, gpointer data)
+{
+  if (value->type != GCONF_VALUE_INT)
+    return;
+
+  if (strcmp (key, GCONF_WIDGET_POOL_SIZE) == 0)
+    self->priv->widget_pool_size = gconf_value_get_int (value);
+  else
+    self->priv->widget_pool_budget = gconf_value_get_int (value);
+
+  widget_pool_trim (self);
+}
+
+static void
+unload_delay_changed (HildonIMUI *self, const gchar *key,
+                      const GConfValue *value, gpointer data)
+{
+  if (value->type == GCONF_VALUE_INT)
+    hildon_im_plugin_set_unload_delay (MAX (gconf_value_get_int (value), 0));
+}
+
+static const struct
+{
+  const gchar *key;
+  HildonIMUISettingsFunc func;
+} builtin_settings_handlers[] =
+{
+  { GCONF_CURRENT_LANGUAGE, current_language_changed },
+  { GCONF_INPUT_METHOD, input_method_changed },
+  { HILDON_IM_GCONF_PRIMARY_LANGUAGE, primary_language_changed },
+  { HILDON_IM_GCONF_SECONDARY_LANGUAGE, secondary_language_changed },
+  { HILDON_IM_GCONF_USE_FINGER_KB, use_finger_kb_changed },
+  { GCONF_IM_HKB_PLUGIN, default_plugin_changed },
+  { GCONF_IM_FINGER_PLUGIN, default_plugin_changed },
+  { GCONF_IM_STYLUS_PLUGIN, default_plugin_changed },
+  { GCONF_EXT_KB_LONG_PRESS_DISABLED, long_press_changed },
+  { GCONF_EXT_KB_LONG_PRESS_TIMEOUT, long_press_changed },
+  { GCONF_WIDGET_POOL_SIZE, widget_pool_changed },
+  { GCONF_WIDGET_POOL_BUDGET, widget_pool_changed },
+  { GCONF_PLUGIN_UNLOAD_DELAY, unload_delay_changed }
+};
+
+static void
+pending_setting_free (gpointer value)
+{
+  if (value != NULL)
+    gconf_value_free (value);
+}
+
+static GHashTable *
+pending_settings_new (void)
+{
+  return g_hash_table_new_full (NULL, NULL, NULL, pending_setting_free);
+}
+
+static void
+dispatch_setting (HildonIMUI *self, GQuark quark, const GConfValue *value)
+{
+  const gchar *key = g_quark_to_string (quark);
+  GSList *handlers, *iter;
+  GArray *ids;
+  guint i;
+
+  /* Handlers may remove handlers, only call those still registered */
+  handlers = g_hash_table_lookup (self->priv->settings_handlers,
+                                  GUINT_TO_POINTER (quark));
+  ids = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (iter = handlers; iter != NULL; iter = iter->next)
+    g_array_append_val (ids, ((SettingsHandler *) iter->data)->id);
+
+  for (i = 0; i < ids->len; i++)
+  {
+    SettingsHandler *handler =
+      g_hash_table_lookup (self->priv->settings_handler_ids,
+                           GUINT_TO_POINTER (g_array_index (ids, guint, i)));
+
+    if (handler != NULL)
+      handler->func (self, key, value, handler->user_data);
   }
+  g_array_free (ids, TRUE);
 
-  for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
+  update_subscribers (self);
+  for (i = 0; i < self->priv->settings_subscribers->len; i++)
   {
-    PluginData *info = (PluginData *) iter->data;
-    if (info->widget != NULL)
+    PluginData *info = g_ptr_array_index (self->priv->settings_subscribers, i);
+    if (info->widget != NULL && plugin_wants_setting (info, key))
     {
       hildon_im_plugin_settings_changed(HILDON_IM_PLUGIN(info->widget),
                                         key, value);
@@ -954,19 +1912,147 @@ hildon_im_ui_gconf_change_callback(GConfClient* client,
   /* TODO default plugins */
 }
 
+/* Handles the notifications received since the last main loop iteration,
+ * each changed key once with its latest value */
+static gboolean
+dispatch_settings (gpointer data)
+{
+  HildonIMUI *self = HILDON_IM_UI (data);
+  GHashTable *values = self->priv->pending_settings;
+  GSList *keys = g_slist_reverse (self->priv->pending_keys);
+  GSList *iter;
+
+  self->priv->settings_idle_id = 0;
+  self->priv->pending_settings = pending_settings_new ();
+  self->priv->pending_keys = NULL;
+
+  for (iter = keys; iter != NULL; iter = iter->next)
+  {
+    GConfValue *value = g_hash_table_lookup (values, iter->data);
+
+    /* Unset keys were never handled */
+    if (value != NULL)
+      dispatch_setting (self, GPOINTER_TO_UINT (iter->data), value);
+  }
+
+  g_slist_free (keys);
+  g_hash_table_destroy (values);
+
+  return FALSE;
+}
+
+static void
+hildon_im_ui_gconf_change_callback(GConfClient* client,
+                                   guint cnxn_id,
+                                   GConfEntry *entry,
+                                   gpointer user_data)
+{
+  HildonIMUI *self;
+  GConfValue *value;
+  gpointer quark;
+
+  self = HILDON_IM_UI(user_data);
+
+  g_return_if_fail(HILDON_IM_IS_UI(self));
+
+  quark = GUINT_TO_POINTER (g_quark_from_string (gconf_entry_get_key(entry)));
+  value = gconf_entry_get_value(entry);
+
+  /* Reads see the change right away, the handlers run later */
+  settings_set (&self->priv->settings, gconf_entry_get_key(entry), value);
+
+  if (!g_hash_table_lookup_extended (self->priv->pending_settings, quark,
+                                     NULL, NULL))
+  {
+    self->priv->pending_keys = g_slist_prepend (self->priv->pending_keys,
+                                                quark);
+  }
+  g_hash_table_insert (self->priv->pending_settings, quark,
+                       value != NULL ? gconf_value_copy (value) : NULL);
+
+  if (self->priv->settings_idle_id == 0)
+    self->priv->settings_idle_id = g_idle_add (dispatch_settings, self);
+}
+
+guint
+hildon_im_ui_add_settings_handler (HildonIMUI *self,
+                                   const gchar *key,
+                                   HildonIMUISettingsFunc func,
+                                   gpointer user_data)
+{
+  SettingsHandler *handler;
+  GSList *handlers;
+
+  g_return_val_if_fail (HILDON_IM_IS_UI (self), 0);
+  g_return_val_if_fail (key != NULL && func != NULL, 0);
+
+  handler = g_new0 (SettingsHandler, 1);
+  handler->id = ++self->priv->last_settings_handler_id;
+  handler->key = g_quark_from_string (key);
+  handler->func = func;
+  handler->user_data = user_data;
+
+  handlers = g_hash_table_lookup (self->priv->settings_handlers,
+                                  GUINT_TO_POINTER (handler->key));
+  g_hash_table_insert (self->priv->settings_handlers,
+                       GUINT_TO_POINTER (handler->key),
+                       g_slist_append (handlers, handler));
+  g_hash_table_insert (self->priv->settings_handler_ids,
+                       GUINT_TO_POINTER (handler->id), handler);
+
+  return handler->id;
+}
+
+void
+hildon_im_ui_remove_settings_handler (HildonIMUI *self,
+                                      guint handler_id)
+{
+  SettingsHandler *handler;
+  GSList *handlers;
+
+  g_return_if_fail (HILDON_IM_IS_UI (self));
+
+  handler = g_hash_table_lookup (self->priv->settings_handler_ids,
+                                 GUINT_TO_POINTER (handler_id));
+  if (handler == NULL)
+    return;
+
+  handlers = g_hash_table_lookup (self->priv->settings_handlers,
+                                  GUINT_TO_POINTER (handler->key));
+  handlers = g_slist_remove (handlers, handler);
+  if (handlers != NULL)
+    g_hash_table_insert (self->priv->settings_handlers,
+                         GUINT_TO_POINTER (handler->key), handlers);
+  else
+    g_hash_table_remove (self->priv->settings_handlers,
+                         GUINT_TO_POINTER (handler->key));
+
+  g_hash_table_remove (self->priv->settings_handler_ids,
+                       GUINT_TO_POINTER (handler_id));
+  g_free (handler);
+}
+
+static void
+free_settings_handlers (gpointer key, gpointer value, gpointer data)
+{
+  g_slist_foreach (value, (GFunc) g_free, NULL);
+  g_slist_free (value);
+}
+
 static void
 hildon_im_ui_load_gconf(HildonIMUI *self)
 {
-  gchar *language;
+  Settings *settings = &self->priv->settings;
+  const gchar *language;
   gint size;
   
   g_return_if_fail(HILDON_IM_IS_UI(self));
 
-  self->priv->current_language_index =
-    gconf_client_get_int (self->client, GCONF_CURRENT_LANGUAGE, NULL);
+  settings_load (self);
 
-  language = gconf_client_get_string(self->client,
-                                     HILDON_IM_GCONF_PRIMARY_LANGUAGE, NULL);
+  self->priv->current_language_index = settings->current_language;
+
+  language = settings->languages[PRIMARY_LANGUAGE];
   if (language == NULL)
     size = 0;
   else
@@ -975,10 +2061,7 @@ hildon_im_ui_load_gconf(HildonIMUI *self)
   strncpy (self->priv->selected_languages [PRIMARY_LANGUAGE], language,
           size > BUFFER_SIZE ? BUFFER_SIZE -1: size);
 
-  g_free(language);
-
-  language = gconf_client_get_string(self->client,
-                                     HILDON_IM_GCONF_SECONDARY_LANGUAGE, NULL);
+  language = settings->languages[SECONDARY_LANGUAGE];
   if (language != NULL && *language != '\0')
   {
     strncpy (self->priv->selected_languages [SECONDARY_LANGUAGE], language,
@@ -988,43 +2071,34 @@ hildon_im_ui_load_gconf(HildonIMUI *self)
   {    
     self->priv->selected_languages[SECONDARY_LANGUAGE][0] = 0;
     self->priv->current_language_index = 0;
-    gint current_value = -1;
-    current_value = gconf_client_get_int (self->client,
-                                          GCONF_CURRENT_LANGUAGE,
-                                          NULL);
-    if (current_value != PRIMARY_LANGUAGE)
+    if (settings->current_language != PRIMARY_LANGUAGE)
         gconf_client_set_int (self->client,
                               GCONF_CURRENT_LANGUAGE, PRIMARY_LANGUAGE, NULL);
   }
-  g_free(language);
 
-  self->priv->use_finger_kb = gconf_client_get_bool(self->client, 
-                                                    HILDON_IM_GCONF_USE_FINGER_KB,
-                                                    NULL);
+  self->priv->use_finger_kb = settings->use_finger_kb;
 
   g_free(self->priv->cached_hkb_plugin_name);
-  self->priv->cached_hkb_plugin_name = gconf_client_get_string (self->client,
-                                                                GCONF_IM_HKB_PLUGIN,
-                                                                NULL);
+  self->priv->cached_hkb_plugin_name = g_strdup (settings->hkb_plugin);
 
   g_free(self->priv->cached_finger_plugin_name);
-  self->priv->cached_finger_plugin_name = gconf_client_get_string (self->client,
-                                                                   GCONF_IM_FINGER_PLUGIN,
-                                                                   NULL);
+  self->priv->cached_finger_plugin_name = g_strdup (settings->finger_plugin);
 
   g_free(self->priv->cached_stylus_plugin_name);
-  self->priv->cached_stylus_plugin_name = gconf_client_get_string (self->client,
-                                                                   GCONF_IM_STYLUS_PLUGIN,
-                                                                   NULL);
+  self->priv->cached_stylus_plugin_name = g_strdup (settings->stylus_plugin);
+  update_default_plugins (self);
 
   self->priv->ext_kb_long_press_disabled =
-    gconf_client_get_bool (self->client,
-                           GCONF_EXT_KB_LONG_PRESS_DISABLED,
-                           NULL);
+    settings->ext_kb_long_press_disabled;
   self->priv->ext_kb_long_press_timeout =
-    gconf_client_get_int (self->client,
-                          GCONF_EXT_KB_LONG_PRESS_TIMEOUT,
-                          NULL);
+    settings->ext_kb_long_press_timeout;
+
+  self->priv->widget_pool_size = settings->widget_pool_size;
+  self->priv->widget_pool_budget = settings->widget_pool_budget;
+  widget_pool_trim (self);
+
+  if (settings->plugin_unload_delay >= 0)
+    hildon_im_plugin_set_unload_delay (settings->plugin_unload_delay);
 }
 
 /* Call a plugin function for each loaded plugin.
@@ -1057,7 +2131,8 @@ hildon_im_ui_foreach_plugin_va(HildonIMUI *self,
                                ...)
 {
   PluginData *plugin;
-  GSList *iter;
+  GPtrArray *subscribers = NULL;
+  guint i;
   va_list ap;
 
   GdkEventType event_type = GDK_NOTHING;
@@ -1072,12 +2147,19 @@ hildon_im_ui_foreach_plugin_va(HildonIMUI *self,
     state = va_arg(ap, guint);
     keyval = va_arg(ap, guint);
     hardware_keycode = va_arg(ap, guint);
+    subscribers = self->priv->key_event_subscribers;
   }
   va_end(ap);
 
-  for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
+  if (subscribers == NULL)
+    return;
+
+  update_subscribers (self);
+  /* A plugin may lose its widget to a callback, but the array is only
+   * rebuilt on the next dispatch */
+  for (i = 0; i < subscribers->len; i++)
   {
-    plugin = (PluginData*) iter->data;
+    plugin = (PluginData*) g_ptr_array_index (subscribers, i);
 
     if (plugin->widget == NULL)
       continue;
@@ -1135,6 +2217,8 @@ hildon_im_ui_set_client(HildonIMUI *self,
   {
     PluginData *info = NULL;
     self->priv->input_window = input_window;
+    self->priv->bulk_window = None;
+    self->priv->bulk_text = FALSE;
 
     info = CURRENT_PLUGIN (self);
 
@@ -1142,6 +2226,7 @@ hildon_im_ui_set_client(HildonIMUI *self,
     {
       hildon_im_ui_send_communication_message(self,
                                               HILDON_IM_CONTEXT_WIDGET_CHANGED);
+      self->priv->n_key_presses = 0;
 
       /* reset shift and level states */
       self->priv->mask = 0;
@@ -1222,6 +2307,11 @@ hildon_im_ui_process_activate_message(HildonIMUI *self,
   if (get_window_pid (msg->app_window) == getpid ())
     return;
 
+  /* The client may have changed, or reused a window id, since the bulk
+   * text support was last asked */
+  self->priv->bulk_window = None;
+  self->priv->bulk_text = FALSE;
+
   /* Check if a request comes from a different main window. Don't change it
      for HIDE events since with browser when opening IM popup menu it sends
      HIDE from app_window 0.. */
@@ -1325,10 +2415,78 @@ hildon_im_ui_toggle_special_plugin(HildonIMUI *self)
   }
 }
 
+static void
+drop_key_press (HildonIMUI *self, guint index)
+{
+  HildonIMUIPrivate *priv = self->priv;
+
+  priv->n_key_presses--;
+  memmove (&priv->key_presses[index], &priv->key_presses[index + 1],
+           (priv->n_key_presses - index) * sizeof (PendingKeyPress));
+}
+
+/* Tracks the presses that may still cause a commit. A key released
+ * without committing anything, like a modifier or an arrow, is dropped so
+ * that it is not charged for a later commit */
+static void
+note_key_event (HildonIMUI *self, HildonIMKeyEventMessage *msg)
+{
+  HildonIMUIPrivate *priv = self->priv;
+  guint i;
+
+  if (msg->type == GDK_KEY_PRESS)
+  {
+    if (priv->n_key_presses == KEY_LATENCY_SLOTS)
+      drop_key_press (self, 0);
+
+    priv->key_presses[priv->n_key_presses].keyval = msg->keyval;
+    priv->key_presses[priv->n_key_presses].time = g_get_monotonic_time ();
+    priv->n_key_presses++;
+  }
+  else if (msg->type == GDK_KEY_RELEASE)
+  {
+    for (i = 0; i < priv->n_key_presses; i++)
+    {
+      if (priv->key_presses[i].keyval == msg->keyval)
+      {
+        drop_key_press (self, i);
+        break;
+      }
+    }
+  }
+}
+
+/* Times the oldest pending key press to the commit it caused, per plugin */
+static void
+record_key_latency (HildonIMUI *self, PluginData *plugin)
+{
+  gint64 latency;
+
+  latency = g_get_monotonic_time () - self->priv->key_presses[0].time;
+  drop_key_press (self, 0);
+
+  if (latency > KEY_LATENCY_MAX)
+    return;
+
+  if (plugin->key_latency == NULL)
+    plugin->key_latency = metrics_histogram_lookup ("key_to_commit",
+                                                    plugin->info->name);
+
+  metrics_histogram_record (plugin->key_latency, latency);
+}
+
 static void
 hildon_im_ui_handle_key_message (HildonIMUI *self, HildonIMKeyEventMessage *msg)
 {
-  self->priv->input_window = msg->input_window;
+  if (self->priv->input_window != msg->input_window)
+  {
+    self->priv->input_window = msg->input_window;
+    self->priv->bulk_window = None;
+    self->priv->bulk_text = FALSE;
+  }
+
+  if (self->priv->key_latency)
+    note_key_event (self, msg);
 
   if (msg->type == GDK_KEY_PRESS && self->priv->current_banner != NULL)
   {
@@ -1344,9 +2502,23 @@ hildon_im_ui_handle_key_message (HildonIMUI *self, HildonIMKeyEventMessage *msg)
                                  msg->hardware_keycode);
 }
 
+/* Appends a piece of a text sent in HILDON_IM_MSG_START and CONTINUE
+ * messages. @buffer is kept between texts, so its capacity is already
+ * sized by the previous one and the reassembly stays linear. Users read
+ * buffer->str in place. */
+static void
+reassemble_chunk(GString *buffer, gint msg_flag, const gchar *chunk)
+{
+  if (msg_flag == HILDON_IM_MSG_START)
+    g_string_truncate (buffer, 0);
+
+  g_string_append_len (buffer, chunk,
+                       strnlen (chunk, HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE));
+}
+
 /*filters client messages to see if we need to show/hide the ui*/
 static GdkFilterReturn
-hildon_im_ui_client_message_filter(GdkXEvent *xevent,
+hildon_im_ui_handle_client_message(GdkXEvent *xevent,
                                    GdkEvent *event,
                                    gpointer data)
 {
@@ -1383,25 +2555,9 @@ hildon_im_ui_client_message_filter(GdkXEvent *xevent,
     {
       HildonIMSurroundingContentMessage *msg =
         (HildonIMSurroundingContentMessage *) &cme->data;
-      gchar *new_surrounding;
-
-      if (msg->msg_flag == HILDON_IM_MSG_START &&
-          self->priv->surrounding)
-      {
-        g_free(self->priv->surrounding);
-        self->priv->surrounding = g_strdup("");
-      }
-
-      new_surrounding = g_strconcat(self->priv->surrounding,
-                                    msg->surrounding,
-                                    NULL);
-
-      if (self->priv->surrounding)
-      {
-        g_free(self->priv->surrounding);
-      }
 
-      self->priv->surrounding = new_surrounding;
+      reassemble_chunk(self->priv->surrounding, msg->msg_flag,
+                       msg->surrounding);
 
       return GDK_FILTER_REMOVE;
     }
@@ -1419,7 +2575,7 @@ hildon_im_ui_client_message_filter(GdkXEvent *xevent,
       if (CURRENT_PLUGIN(self) != NULL && CURRENT_IM_WIDGET(self) != NULL)
       {
         hildon_im_plugin_surrounding_received(CURRENT_IM_PLUGIN (self),
-                                              self->priv->surrounding,
+                                              self->priv->surrounding->str,
                                               self->priv->surrounding_offset);
       }
       
@@ -1432,20 +2588,9 @@ hildon_im_ui_client_message_filter(GdkXEvent *xevent,
     {
       HildonIMPreeditCommittedContentMessage *msg =
                           (HildonIMPreeditCommittedContentMessage *) &cme->data;
-      gchar *new_committed_preedit;
-
-      if (msg->msg_flag == HILDON_IM_MSG_START && self->priv->committed_preedit)
-      {
-        g_free(self->priv->committed_preedit);
-        self->priv->committed_preedit = g_strdup("");
-      }
 
-      new_committed_preedit = g_strconcat(self->priv->committed_preedit,
-                                          msg->committed_preedit,
-                                          NULL);
-
-      g_free(self->priv->committed_preedit);
-      self->priv->committed_preedit = new_committed_preedit;
+      reassemble_chunk(self->priv->committed_preedit, msg->msg_flag,
+                       msg->committed_preedit);
 
       return GDK_FILTER_REMOVE;
     }
@@ -1459,8 +2604,11 @@ hildon_im_ui_client_message_filter(GdkXEvent *xevent,
 
       self->priv->commit_mode = msg->commit_mode;
 
-      hildon_im_plugin_preedit_committed(CURRENT_IM_PLUGIN (self),
-                                         self->priv->committed_preedit);
+      if (CURRENT_PLUGIN(self) != NULL && CURRENT_IM_WIDGET(self) != NULL)
+      {
+        hildon_im_plugin_preedit_committed(CURRENT_IM_PLUGIN (self),
+                                           self->priv->committed_preedit->str);
+      }
 
       return GDK_FILTER_REMOVE;
     }
@@ -1472,6 +2620,7 @@ hildon_im_ui_client_message_filter(GdkXEvent *xevent,
       HildonIMKeyEventMessage *msg =
         (HildonIMKeyEventMessage *) &cme->data;
 
+      metrics_count (METRICS_KEY_EVENTS, 1);
       hildon_im_ui_handle_key_message (self, msg);
       return GDK_FILTER_REMOVE;
     }
@@ -1497,6 +2646,49 @@ hildon_im_ui_client_message_filter(GdkXEvent *xevent,
   return GDK_FILTER_CONTINUE;
 }
 
+/* Maps a ClientMessage type to its HildonIMAtom, or to HILDON_IM_NUM_ATOMS
+ * if it is not part of the protocol */
+static guint
+hildon_im_ui_message_type(Atom message_type)
+{
+  static Atom atoms[HILDON_IM_NUM_ATOMS];
+  guint i;
+
+  if (atoms[0] == None)
+  {
+    for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+      atoms[i] = hildon_im_protocol_get_atom (i);
+  }
+
+  for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+  {
+    if (atoms[i] == message_type)
+      break;
+  }
+
+  return i;
+}
+
+static GdkFilterReturn
+hildon_im_ui_client_message_filter(GdkXEvent *xevent,
+                                   GdkEvent *event,
+                                   gpointer data)
+{
+  GdkFilterReturn ret;
+
+  if (((XEvent *) xevent)->type == ClientMessage)
+    metrics_count_message (hildon_im_ui_message_type (
+                             ((XClientMessageEvent *) xevent)->message_type));
+
+  HIM_PROBE3(client_message_filter__entry, ((XEvent *) xevent)->type,
+             ((XClientMessageEvent *) xevent)->message_type,
+             ((XClientMessageEvent *) xevent)->format);
+  ret = hildon_im_ui_handle_client_message(xevent, event, data);
+  HIM_PROBE1(client_message_filter__return, ret);
+
+  return ret;
+}
+
 static gboolean
 hildon_im_ui_x_window_should_be_ignored (Window window,
                                          gchar *window_type)
@@ -1627,7 +2819,7 @@ get_window_pid (Window window)
 }
 
 static GdkFilterReturn
-hildon_im_ui_focus_message_filter(GdkXEvent *xevent, GdkEvent *event,
+hildon_im_ui_handle_focus_message(GdkXEvent *xevent, GdkEvent *event,
                                   gpointer data)
 {
   HildonIMUI *self=NULL;
@@ -1686,6 +2878,20 @@ hildon_im_ui_focus_message_filter(GdkXEvent *xevent, GdkEvent *event,
   return GDK_FILTER_CONTINUE;
 }
 
+static GdkFilterReturn
+hildon_im_ui_focus_message_filter(GdkXEvent *xevent, GdkEvent *event,
+                                  gpointer data)
+{
+  GdkFilterReturn ret;
+
+  HIM_PROBE2(focus_message_filter__entry, ((XEvent *) xevent)->type,
+             ((XPropertyEvent *) xevent)->atom);
+  ret = hildon_im_ui_handle_focus_message(xevent, event, data);
+  HIM_PROBE1(focus_message_filter__return, ret);
+
+  return ret;
+}
+
 static void
 hildon_im_ui_init_root_window_properties(HildonIMUI *self)
 {
@@ -1724,7 +2930,32 @@ hildon_im_ui_finalize(GObject *obj)
   g_return_if_fail(HILDON_IM_IS_UI(obj));
   self = HILDON_IM_UI(obj);
 
+  if (self->priv->prewarm_id != 0)
+    g_source_remove (self->priv->prewarm_id);
+  if (self->priv->cache_reload_id != 0)
+    g_source_remove (self->priv->cache_reload_id);
+  if (self->priv->cache_monitor != NULL)
+  {
+    g_file_monitor_cancel (self->priv->cache_monitor);
+    g_object_unref (self->priv->cache_monitor);
+  }
+
   cleanup_plugins (self);
+  g_queue_free (self->priv->widget_pool);
+  g_ptr_array_free (self->priv->key_event_subscribers, TRUE);
+  g_ptr_array_free (self->priv->settings_subscribers, TRUE);
+
+  if (self->priv->settings_idle_id != 0)
+    g_source_remove (self->priv->settings_idle_id);
+  if (self->priv->flush_id != 0)
+    g_source_remove (self->priv->flush_id);
+  g_hash_table_destroy (self->priv->pending_settings);
+  g_slist_free (self->priv->pending_keys);
+  g_hash_table_foreach (self->priv->settings_handlers,
+                        free_settings_handlers, NULL);
+  g_hash_table_destroy (self->priv->settings_handlers);
+  g_hash_table_destroy (self->priv->settings_handler_ids);
+  settings_clear (&self->priv->settings);
   
   if (self->osso)
   {
@@ -1739,6 +2970,8 @@ hildon_im_ui_finalize(GObject *obj)
   gconf_client_remove_dir(self->client, HILDON_IM_GCONF_DIR, NULL);
   g_object_unref(self->client);
   g_string_free(self->priv->plugin_buffer, TRUE);
+  g_string_free(self->priv->surrounding, TRUE);
+  g_string_free(self->priv->committed_preedit, TRUE);
   
   g_free(self->priv->cached_hkb_plugin_name);
   g_free(self->priv->cached_finger_plugin_name);
@@ -1799,16 +3032,30 @@ hildon_im_ui_init(HildonIMUI *self)
 {
   HildonIMUIPrivate *priv;
   osso_return_t status;
+  guint i;
 
   g_return_if_fail(HILDON_IM_IS_UI(self));
 
   self->priv = priv = (HildonIMUIPrivate*)hildon_im_ui_get_instance_private(self);
 
   priv->current_plugin = NULL;
-  priv->surrounding = g_strdup("");
-  priv->committed_preedit = g_strdup("");
+  priv->surrounding = g_string_new(NULL);
+  priv->committed_preedit = g_string_new(NULL);
   priv->plugin_buffer = g_string_new(NULL);
   priv->current_banner = NULL;
+  priv->widget_pool = g_queue_new ();
+  priv->key_event_subscribers = g_ptr_array_new ();
+  priv->settings_subscribers = g_ptr_array_new ();
+  priv->settings_handlers = g_hash_table_new (NULL, NULL);
+  priv->settings_handler_ids = g_hash_table_new (NULL, NULL);
+  priv->pending_settings = pending_settings_new ();
+  priv->key_latency = g_getenv (METRICS_KEY_LATENCY_ENV) != NULL;
+
+  if (sent_serials == NULL)
+  {
+    sent_serials = g_array_new (FALSE, FALSE, sizeof (gulong));
+    chained_error_handler = XSetErrorHandler (hildon_im_ui_x_error_handler);
+  }
 
   /* default */
   priv->options = 0;
@@ -1830,14 +3077,25 @@ hildon_im_ui_init(HildonIMUI *self)
   priv->mask = 0;
 
   self->osso = osso_initialize(PACKAGE_OSSO, VERSION, FALSE, NULL);
+  profile_mark ("osso_initialize");
   if (!self->osso)
   {
     g_warning("Could not initialize osso from " PACKAGE);
   }
 
+  /* Fetch the whole tree at once: the settings snapshot and the language
+   * descriptions are then read from the client cache */
+  settings_init (&priv->settings);
   gconf_client_add_dir(self->client,
-                       HILDON_IM_GCONF_DIR, GCONF_CLIENT_PRELOAD_ONELEVEL,
+                       HILDON_IM_GCONF_DIR, GCONF_CLIENT_PRELOAD_RECURSIVE,
                        NULL);
+  for (i = 0; i < G_N_ELEMENTS (builtin_settings_handlers); i++)
+  {
+    hildon_im_ui_add_settings_handler (self,
+                                       builtin_settings_handlers[i].key,
+                                       builtin_settings_handlers[i].func,
+                                       NULL);
+  }
   gconf_client_notify_add(self->client, HILDON_IM_GCONF_DIR,
                           hildon_im_ui_gconf_change_callback,
                           self, NULL, NULL);
@@ -1851,13 +3109,19 @@ hildon_im_ui_init(HildonIMUI *self)
   gtk_widget_set_name (GTK_WIDGET (self), "hildon-input-method-ui");
 
   self->priv->plugins_available = init_plugins (self);
+  profile_mark ("init_plugins");
   hildon_im_ui_load_gconf(self);
+  profile_mark ("hildon_im_ui_load_gconf");
   if (self->priv->plugins_available == FALSE)
   {
     g_warning ("Failed loading the plugins.");
     g_warning ("No IM will show.");
   }
   init_persistent_plugins(self);
+  profile_mark ("init_persistent_plugins");
+  watch_plugin_cache (self);
+  check_plugin_cache (self);
+  schedule_prewarm (self);
 
 #ifdef MAEMO_CHANGES
   priv->first_boot = TRUE;
@@ -1868,10 +3132,30 @@ hildon_im_ui_init(HildonIMUI *self)
   g_message("ui up and running");
 }
 
+/* Ends the show latency measurement started by hildon_im_ui_show() */
+static gboolean
+hildon_im_ui_map_event(GtkWidget *widget, GdkEventAny *event)
+{
+  HildonIMUI *self = HILDON_IM_UI(widget);
+
+  if (self->priv->show_requested != 0)
+  {
+    metrics_record (METRICS_SHOW_LATENCY,
+                    g_get_monotonic_time () - self->priv->show_requested);
+    self->priv->show_requested = 0;
+  }
+
+  if (GTK_WIDGET_CLASS(hildon_im_ui_parent_class)->map_event)
+    return GTK_WIDGET_CLASS(hildon_im_ui_parent_class)->map_event(widget,
+                                                                  event);
+  return FALSE;
+}
+
 static void
 hildon_im_ui_class_init(HildonIMUIClass *klass)
 {
   G_OBJECT_CLASS(klass)->finalize = hildon_im_ui_finalize;
+  GTK_WIDGET_CLASS(klass)->map_event = hildon_im_ui_map_event;
 }
 
 /* Public methods **********************************************/
@@ -1914,13 +3198,14 @@ hildon_im_ui_new()
     g_info("_NET_ACTIVE_WINDOW %lu", self->priv->net_active_window);
 
   hildon_im_ui_init_root_window_properties(self);
+  profile_mark ("root_window_properties");
   return GTK_WIDGET(self);
 }
 
 const gchar *
 hildon_im_ui_get_surrounding(HildonIMUI *self)
 {
-  return self->priv->surrounding;
+  return self->priv->surrounding->str;
 }
 
 gint
@@ -1953,6 +3238,10 @@ flush_plugins(HildonIMUI *self,
 {
   GSList *iter;
 
+  HIM_PROBE2(flush_plugins__entry,
+             current != NULL ? current->info->name : NULL, force);
+  metrics_count (METRICS_FLUSHES, 1);
+
   for (iter = self->priv->all_methods; iter != NULL; iter = iter->next)
   {
     gboolean flush = TRUE;
@@ -1974,25 +3263,128 @@ flush_plugins(HildonIMUI *self,
       {
         flush = FALSE;
       }
+      /* Nor before a pre-warmed plugin had its first use */
+      if (i->prewarmed && force == FALSE)
+      {
+        flush = FALSE;
+      }
 
       if (flush == TRUE)
       {
-        hildon_im_plugin_disable(HILDON_IM_PLUGIN(i->widget));
-        i->enabled = FALSE;
-
-        gtk_widget_destroy(i->widget);
-        i->widget = NULL;
+        if (force == FALSE)
+          park_plugin_widget (self, i);
+        else
+          destroy_plugin_widget (self, i);
       } else
       {
         gtk_widget_hide (i->widget);
       }
     }
   }
+
+  if (force == FALSE)
+    widget_pool_trim (self);
+
+  HIM_PROBE1(flush_plugins__return, g_queue_get_length (self->priv->widget_pool));
 }
 
+typedef struct
+{
+  HildonIMUI *self;
+  gchar *filename;
+  gboolean init;
+  guint serial;
+} PendingActivation;
+
+/* The previous plugin keeps the input until the new widget exists, so it
+ * only starts its transition and is flushed here */
 static void
-activate_plugin (HildonIMUI *self, PluginData *plugin,
-                 gboolean init)
+finish_activation (HildonIMUI *self, PluginData *plugin, gboolean init)
+{
+  self->priv->activating = FALSE;
+
+  if (CURRENT_PLUGIN(self) && CURRENT_IM_WIDGET(self))
+    hildon_im_plugin_transition(CURRENT_IM_PLUGIN(self), TRUE);
+
+  flush_plugins (self, plugin, FALSE);
+
+  plugin->prewarmed = FALSE;
+  set_current_plugin (self, plugin);
+  
+  hildon_im_plugin_enable (CURRENT_IM_PLUGIN (self), init);
+  self->priv->current_plugin->enabled = TRUE;
+  hildon_im_plugin_transition(CURRENT_IM_PLUGIN(self), FALSE);
+
+  if (self->priv->language_pending)
+  {
+    self->priv->language_pending = FALSE;
+    hildon_im_ui_foreach_plugin(self, hildon_im_plugin_language);
+  }
+}
+
+/* Completes an activate_plugin() that had to create the widget. The
+ * plugin list may have been reloaded, and other plugins activated, in the
+ * meantime. */
+static void
+plugin_created (HildonIMPlugin *widget, gpointer data)
+{
+  PendingActivation *pending = (PendingActivation *) data;
+  HildonIMUI *self = pending->self;
+  PluginData *plugin;
+
+  plugin = find_plugin_by_filename (&self->priv->registry,
+                                    pending->filename);
+
+  if (widget == NULL)
+  {
+    g_warning ("Unable create widget for %s", pending->filename);
+  }
+  else if (plugin == NULL || plugin->widget != NULL)
+  {
+    gtk_widget_destroy (GTK_WIDGET (widget));
+  }
+  else
+  {
+    plugin->widget = GTK_WIDGET (widget);
+    plugin->enabled = FALSE;
+    invalidate_subscribers (self);
+  }
+
+  if (plugin == NULL || plugin->widget == NULL)
+  {
+    /* The previous plugin stays, as it never started its transition */
+    if (pending->serial == self->priv->activation_serial)
+    {
+      self->priv->activating = FALSE;
+      if (self->priv->language_pending)
+      {
+        self->priv->language_pending = FALSE;
+        if (CURRENT_PLUGIN(self) && CURRENT_IM_WIDGET(self))
+          hildon_im_ui_foreach_plugin(self, hildon_im_plugin_language);
+      }
+    }
+  }
+  else
+  {
+    if (pending->serial == self->priv->activation_serial)
+    {
+      finish_activation (self, plugin, pending->init);
+    }
+    else if (plugin != self->priv->current_plugin && !plugin->enabled &&
+             !plugin->prewarmed && plugin->pool_link == NULL)
+    {
+      park_plugin_widget (self, plugin);
+      widget_pool_trim (self);
+    }
+  }
+
+  g_free (pending->filename);
+  g_free (pending);
+}
+
+static void
+do_activate_plugin (HildonIMUI *self, PluginData *plugin,
+                    gboolean init)
 {
   gboolean activate_special = FALSE;
   
@@ -2000,35 +3392,44 @@ activate_plugin (HildonIMUI *self, PluginData *plugin,
   g_return_if_fail (plugin != NULL);
 
   if (plugin == self->priv->current_plugin &&
-      plugin->widget != NULL)
+      plugin->widget != NULL && plugin->pool_link == NULL)
     return;
 
-  if (CURRENT_PLUGIN(self) && CURRENT_IM_PLUGIN(self))
-    hildon_im_plugin_transition(CURRENT_IM_PLUGIN(self), TRUE);
-
   if (plugin->info->type == HILDON_IM_TYPE_SPECIAL || plugin->info->type == HILDON_IM_TYPE_SPECIAL_STANDALONE)
     activate_special = TRUE;
 
   (void)activate_special;
 
-  flush_plugins(self, plugin, FALSE);
-
-  /* Make sure current plugin is created and packed! */
+  /* Make sure current plugin is created and packed! Loading it must not
+   * hold up the events, see plugin_created() */
   if (plugin->widget == NULL)
   {
-    plugin->widget = GTK_WIDGET (hildon_im_plugin_create (self, plugin->filename));
-    if (plugin->widget == NULL)
-    {
-      g_warning ("Unable create widget for %s", plugin->info->name);
-      return;
-    }
+    PendingActivation *pending = g_new0 (PendingActivation, 1);
+
+    pending->self = self;
+    pending->filename = g_strdup (plugin->filename);
+    pending->init = init;
+    pending->serial = ++self->priv->activation_serial;
+    self->priv->activating = TRUE;
+    hildon_im_plugin_create_async (self, plugin->filename,
+                                   plugin_created, pending);
+    return;
   }
 
-  set_current_plugin (self, plugin);
-  
-  hildon_im_plugin_enable (CURRENT_IM_PLUGIN (self), init);
-  self->priv->current_plugin->enabled = TRUE;
-  hildon_im_plugin_transition(CURRENT_IM_PLUGIN(self), FALSE);
+  self->priv->activation_serial++;
+  finish_activation (self, plugin, init);
+}
+
+static void
+activate_plugin (HildonIMUI *self, PluginData *plugin,
+                 gboolean init)
+{
+  HIM_PROBE2(activate_plugin__entry,
+             plugin != NULL ? plugin->info->name : NULL, init);
+  metrics_count (METRICS_ACTIVATIONS, 1);
+  do_activate_plugin (self, plugin, init);
+  HIM_PROBE1(activate_plugin__return,
+             plugin != NULL ? plugin->info->name : NULL);
 }
 
 void 
@@ -2068,59 +3469,198 @@ get_next_packet_start(const char *utf8)
   return candidate;
 }
 
+/* Drops the sends the X server is known to have processed, their errors
+ * would have been received already */
 static void
-hildon_im_ui_send_event(HildonIMUI *self, Window window, XEvent *event)
+prune_sent_serials(gulong processed)
+{
+  guint n = 0;
+
+  while (n < sent_serials->len &&
+         g_array_index (sent_serials, gulong, n) <= processed)
+    n++;
+
+  if (n > 0)
+    g_array_remove_range (sent_serials, 0, n);
+}
+
+/* Takes the errors of our XSendEvent requests, everything else goes to
+ * the handler of GDK */
+static int
+hildon_im_ui_x_error_handler(Display *dpy, XErrorEvent *error)
+{
+  gboolean ours = FALSE;
+  guint i;
+
+  for (i = 0; i < sent_serials->len; i++)
+  {
+    gulong serial = g_array_index (sent_serials, gulong, i);
+
+    if (serial >= error->serial)
+    {
+      ours = serial == error->serial;
+      break;
+    }
+  }
+  prune_sent_serials (error->serial);
+
+  if (!ours)
+    return chained_error_handler (dpy, error);
+
+  /* Sometimes we recieve a BadWindow error, because the input_window id
+   * is wrong. Here we prevent the self from crashing */
+  if (error->error_code != BadWindow)
+    g_warning ("Received the X error %d\n", error->error_code);
+
+  return 0;
+}
+
+/* Sends out the requests queued in this main loop iteration */
+static gboolean
+flush_sent_events(gpointer data)
+{
+  HildonIMUI *self = HILDON_IM_UI(data);
+  Display *dpy = GDK_DISPLAY();
+
+  self->priv->flush_id = 0;
+
+  XFlush (dpy);
+  prune_sent_serials (LastKnownRequestProcessed (dpy));
+
+  return FALSE;
+}
+
+/* Prepares for a request on a client window that may fail. Any error is
+ * reported to hildon_im_ui_x_error_handler() later on, instead of waiting
+ * for the server here */
+static void
+watch_next_request(HildonIMUI *self, Display *dpy)
 {
-  gint xerror;
+  gulong serial = NextRequest (dpy);
+
+  g_array_append_val (sent_serials, serial);
+
+  if (self->priv->flush_id == 0)
+    self->priv->flush_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+                                            flush_sent_events, self, NULL);
+}
 
+static void
+hildon_im_ui_send_event(HildonIMUI *self, Window window, XEvent *event)
+{
   g_return_if_fail(HILDON_IM_IS_UI(self));
   g_return_if_fail(event);
 
   if(window != None )
   {
+    Display *dpy = GDK_DISPLAY();
+
     event->xclient.type = ClientMessage;
     event->xclient.window = window;
 
-    /* trap X errors. Sometimes we recieve a badwindow error,
-     * because the input_window id is wrong.
-     */
-    gdk_error_trap_push();
+    HIM_PROBE3(send_event__entry, window, event->xclient.message_type,
+               event->xclient.format);
 
-    XSendEvent(GDK_DISPLAY(), window, False, 0, event);
-    XSync( GDK_DISPLAY(), False );
+    watch_next_request (self, dpy);
+    XSendEvent(dpy, window, False, 0, event);
+    metrics_count (METRICS_SEND_EVENTS, 1);
 
-    xerror = gdk_error_trap_pop();
-    if( xerror )
-    {
-      if( xerror == BadWindow )
-      {
-        /* Here we prevent the self from crashing */
-        /*g_warning( "UI recieved a BadWindow error."
-          " This was most probably caused by a false "
-          "input window id. Please tap on the text "
-          "widget again to update the XID. \n" );   */
-      }
-      else
-      {
-        g_warning( "Received the X error %d\n", xerror );
-      }
-    }
+    HIM_PROBE2(send_event__return, window, NextRequest (dpy) - 1);
   }
 }
 
-void
-hildon_im_ui_send_utf8(HildonIMUI *self, const gchar *utf8)
+/* Whether the client owning the input window takes bulk text, see
+ * HILDON_IM_BULK_TEXT_SUPPORTED. Asked again after every activation or
+ * input window change */
+static gboolean
+client_takes_bulk_text(HildonIMUI *self)
 {
-  HildonIMInsertUtf8Message *msg=NULL;
-  XEvent event;
-  gint flag;
+  Window window = self->priv->input_window;
+  Atom actual_type;
+  gint actual_format;
+  unsigned long nitems, bytes_after;
+  unsigned char *data = NULL;
 
-  g_return_if_fail(HILDON_IM_IS_UI(self));
+  if (window == None)
+    return FALSE;
 
-  if (utf8 == NULL || self->priv->input_window == None)
+  if (window == self->priv->bulk_window)
+    return self->priv->bulk_text;
+
+  self->priv->bulk_window = window;
+  self->priv->bulk_text = FALSE;
+
+  gdk_error_trap_push ();
+  if (XGetWindowProperty (GDK_DISPLAY (), window,
+                          gdk_x11_get_xatom_by_name (HILDON_IM_BULK_TEXT_SUPPORTED),
+                          0, 1, False, XA_CARDINAL,
+                          &actual_type, &actual_format, &nitems, &bytes_after,
+                          &data) == Success &&
+      actual_type == XA_CARDINAL && actual_format == 32 && nitems == 1)
   {
-    return;
+    self->priv->bulk_text = *(long *) data >= HILDON_IM_BULK_TEXT_VERSION;
   }
+  gdk_error_trap_pop ();
+
+  if (data != NULL)
+    XFree (data);
+
+  return self->priv->bulk_text;
+}
+
+/* Sends @text as a @message_type sequence in one property change. Returns
+ * FALSE if it has to be split into ClientMessages instead */
+static gboolean
+send_bulk_text(HildonIMUI *self, HildonIMAtom message_type, const gchar *text)
+{
+  Display *dpy = GDK_DISPLAY();
+  HildonIMBulkTextMessage *msg;
+  gchar name[sizeof (HILDON_IM_BULK_TEXT_PROPERTY) + 8];
+  XEvent event;
+  gsize len = strlen (text);
+  glong max_len;
+  Atom property;
+
+  /* XChangeProperty has a 24 byte header */
+  max_len = XExtendedMaxRequestSize (dpy);
+  if (max_len == 0)
+    max_len = XMaxRequestSize (dpy);
+  max_len = max_len * 4 - 24;
+
+  if (len < BULK_TEXT_MIN_LENGTH || len > max_len ||
+      !client_takes_bulk_text (self))
+    return FALSE;
+
+  g_snprintf (name, sizeof (name), HILDON_IM_BULK_TEXT_PROPERTY "%u",
+              self->priv->bulk_slot);
+  self->priv->bulk_slot = (self->priv->bulk_slot + 1) % HILDON_IM_BULK_TEXT_SLOTS;
+  property = gdk_x11_get_xatom_by_name (name);
+
+  watch_next_request (self, dpy);
+  XChangeProperty (dpy, self->priv->input_window, property,
+                   gdk_x11_get_xatom_by_name ("UTF8_STRING"), 8,
+                   PropModeReplace, (const guchar *) text, len);
+
+  memset (&event, 0, sizeof (XEvent));
+  event.xclient.message_type = gdk_x11_get_xatom_by_name (HILDON_IM_BULK_TEXT);
+  event.xclient.format = HILDON_IM_BULK_TEXT_FORMAT;
+
+  msg = (HildonIMBulkTextMessage *) &event.xclient.data;
+  msg->message_type = hildon_im_protocol_get_atom (message_type);
+  msg->property = property;
+  msg->length = len;
+
+  hildon_im_ui_send_event (self, self->priv->input_window, &event);
+
+  return TRUE;
+}
+
+static void
+send_utf8_pieces(HildonIMUI *self, const gchar *utf8)
+{
+  HildonIMInsertUtf8Message *msg=NULL;
+  XEvent event;
+  gint flag;
 
   flag = HILDON_IM_MSG_START;
 
@@ -2148,12 +3688,36 @@ hildon_im_ui_send_utf8(HildonIMUI *self, const gchar *utf8)
     memcpy(msg->utf8_str, utf8, len);
 
     hildon_im_ui_send_event(self, self->priv->input_window, &event);
+    metrics_count (METRICS_BYTES_COMMITTED, len);
 
     utf8 = (gchar *) next_start;
     flag = HILDON_IM_MSG_CONTINUE;
   } while (*utf8);
 }
 
+void
+hildon_im_ui_send_utf8(HildonIMUI *self, const gchar *utf8)
+{
+  g_return_if_fail(HILDON_IM_IS_UI(self));
+
+  if (utf8 == NULL || self->priv->input_window == None)
+  {
+    return;
+  }
+
+  HIM_PROBE2(send_utf8__entry, self->priv->input_window, strlen (utf8));
+
+  if (send_bulk_text (self, HILDON_IM_INSERT_UTF8, utf8))
+    metrics_count (METRICS_BYTES_COMMITTED, strlen (utf8));
+  else
+    send_utf8_pieces (self, utf8);
+
+  if (self->priv->n_key_presses > 0 && CURRENT_PLUGIN(self) != NULL)
+    record_key_latency (self, CURRENT_PLUGIN(self));
+
+  HIM_PROBE1(send_utf8__return, self->priv->input_window);
+}
+
 void
 hildon_im_ui_send_communication_message(HildonIMUI *self,
                                         gint message)
@@ -2181,7 +3745,10 @@ hildon_im_ui_send_surrounding_content_hildon(HildonIMUI *self,
   HildonIMSurroundingContentMessage *msg=NULL;
   XEvent event;
   gint flag;
-  
+
+  if (send_bulk_text (self, HILDON_IM_SURROUNDING_CONTENT, surrounding))
+    return;
+
   flag = HILDON_IM_MSG_START;
 
   /* Split surrounding context into pieces that are small enough */
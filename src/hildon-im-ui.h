@@ -79,6 +79,39 @@ typedef struct _HildonIMUIPrivate HildonIMUIPrivate;
 
 #define HILDON_IM_DEFAULT_HEIGHT -1
 
+/**
+ * Bulk text transfer
+ *
+ * A client that can take text in one piece sets the
+ * HILDON_IM_BULK_TEXT_SUPPORTED property (CARDINAL/32, holding
+ * HILDON_IM_BULK_TEXT_VERSION) on its input window. Large
+ * HILDON_IM_INSERT_UTF8 and HILDON_IM_SURROUNDING_CONTENT payloads are then
+ * stored as UTF8_STRING in one of the HILDON_IM_BULK_TEXT_SLOTS properties
+ * HILDON_IM_BULK_TEXT_PROPERTY "0" .. "7" of the input window, and
+ * announced by a single HILDON_IM_BULK_TEXT ClientMessage carrying a
+ * HildonIMBulkTextMessage. The client reads and deletes the property, and
+ * handles its contents like a complete START to END message sequence.
+ * Other clients get the usual ClientMessage pieces.
+ *
+ * The client side lives in the IM context of hildon-input-method-framework,
+ * which has to set the property and handle the message before any text
+ * takes this path. These definitions belong next to the other messages in
+ * its hildon-im-protocol.h, and are to move there once it carries them.
+ */
+#define HILDON_IM_BULK_TEXT_SUPPORTED "_HILDON_IM_BULK_TEXT_SUPPORTED"
+#define HILDON_IM_BULK_TEXT_VERSION 1
+#define HILDON_IM_BULK_TEXT "_HILDON_IM_BULK_TEXT"
+#define HILDON_IM_BULK_TEXT_FORMAT 32
+#define HILDON_IM_BULK_TEXT_PROPERTY "_HILDON_IM_BULK_TEXT_"
+#define HILDON_IM_BULK_TEXT_SLOTS 8
+
+typedef struct
+{
+  Atom message_type;    /* HILDON_IM_INSERT_UTF8 or SURROUNDING_CONTENT */
+  Atom property;
+  long length;          /* in bytes, without a terminator */
+} HildonIMBulkTextMessage;
+
 /**
  * The common IM buttons
  */
@@ -212,6 +245,46 @@ void hildon_im_ui_set_keyboard_state(HildonIMUI *self,
  */
 void hildon_im_ui_set_visible(HildonIMUI *ui, gboolean visible);
 
+/**
+ * HildonIMUISettingsFunc:
+ * @ui: #HildonIMUI
+ * @key: the GConf key that changed
+ * @value: its new value
+ * @user_data: the data given to hildon_im_ui_add_settings_handler()
+ *
+ * Called for a changed key under the IM GConf directory. A key written
+ * several times in a row is only reported once, with its latest value.
+ */
+typedef void (*HildonIMUISettingsFunc) (HildonIMUI *ui,
+                                        const gchar *key,
+                                        const GConfValue *value,
+                                        gpointer user_data);
+
+/**
+ * hildon_im_ui_add_settings_handler:
+ * @ui: #HildonIMUI
+ * @key: the full GConf key to watch
+ * @func: called when @key changes
+ * @user_data: data for @func
+ *
+ * Registers a handler for one key under the IM GConf directory
+ *
+ * Returns: an id for hildon_im_ui_remove_settings_handler()
+ */
+guint hildon_im_ui_add_settings_handler(HildonIMUI *ui,
+                                        const gchar *key,
+                                        HildonIMUISettingsFunc func,
+                                        gpointer user_data);
+
+/**
+ * hildon_im_ui_remove_settings_handler:
+ * @ui: #HildonIMUI
+ * @handler_id: the id returned by hildon_im_ui_add_settings_handler()
+ *
+ * Removes a settings handler
+ */
+void hildon_im_ui_remove_settings_handler(HildonIMUI *ui, guint handler_id);
+
 
 /*******************************************************************
  * Plugin interaction
@@ -25,6 +25,7 @@
 #define __HILDON_IM_UI_INTERNAL_H__
 
 #include "hildon-im-ui.h"
+#include "hildon-im-plugin.h"
 
 #define FREE_IF_SET(a) if (a) { g_free(a); a = NULL; }
 
@@ -38,4 +39,41 @@
  * it is intended that it will not be available to the external world, and
  * this file will not be included in the development package. */
 void hildon_im_reload_plugins (HildonIMUI *self);
+
+/**
+ * hildon_im_plugin_set_unload_delay:
+ * @seconds: quiet period, 0 to unload right away
+ *
+ * Sets how long a plugin module stays loaded after its last plugin
+ * instance has been destroyed.
+ */
+void hildon_im_plugin_set_unload_delay (guint seconds);
+
+/**
+ * hildon_im_plugin_unload_idle_modules:
+ *
+ * Unloads the plugin modules without live instances, without waiting for
+ * their quiet period to end.
+ */
+void hildon_im_plugin_unload_idle_modules (void);
+
+typedef void (*HildonIMPluginCreateFunc) (HildonIMPlugin *plugin,
+                                          gpointer user_data);
+
+/**
+ * hildon_im_plugin_create_async:
+ * @keyboard: #HildonIMUI
+ * @plugin_name: the name
+ * @callback: called with the new plugin, or %NULL on failure
+ * @user_data: data for @callback
+ *
+ * Like hildon_im_plugin_create(), but opens the shared object and resolves
+ * its symbols on a worker thread. The types are registered and the plugin
+ * created on the main thread, right before @callback is called. If the
+ * module is already loaded, @callback is called before returning.
+ */
+void hildon_im_plugin_create_async (HildonIMUI *keyboard,
+                                    const gchar *plugin_name,
+                                    HildonIMPluginCreateFunc callback,
+                                    gpointer user_data);
 #endif
@@ -0,0 +1,328 @@
+/*
+ * This file is part of hildon-input-method
+ *
+ * Copyright (C) 2007 Nokia Corporation.
+ *
+ * Contact: Mohammad Anwari <Mohammad.Anwari@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <hildon-im-protocol.h>
+#include "metrics.h"
+
+static const gchar *counter_names[METRICS_NUM_COUNTERS] =
+{
+  "key_events",
+  "activations",
+  "plugin_creates",
+  "plugin_destroys",
+  "flushes",
+  "x_send_events",
+  "bytes_committed"
+};
+
+static const gchar *histogram_names[METRICS_NUM_HISTOGRAMS] =
+{
+  "show_latency"
+};
+
+static const guint percentiles[] = { 50, 90, 99 };
+
+static guint64 counters[METRICS_NUM_COUNTERS];
+static guint64 messages[HILDON_IM_NUM_ATOMS + 1];
+static MetricsHistogram histograms[METRICS_NUM_HISTOGRAMS];
+/* "family:name" to MetricsHistogram, see metrics_histogram_lookup() */
+static GHashTable *keyed_histograms = NULL;
+/* "family:name" to guint64, see metrics_count_keyed() */
+static GHashTable *keyed_counters = NULL;
+
+void
+metrics_count (MetricsCounter counter, guint n)
+{
+  g_return_if_fail (counter < METRICS_NUM_COUNTERS);
+
+  counters[counter] += n;
+}
+
+void
+metrics_count_message (guint type)
+{
+  messages[MIN (type, HILDON_IM_NUM_ATOMS)]++;
+}
+
+void
+metrics_count_keyed (const gchar *family, const gchar *name, guint n)
+{
+  guint64 *counter;
+  gchar *key;
+
+  if (keyed_counters == NULL)
+    keyed_counters = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+
+  key = g_strconcat (family, ":", name, NULL);
+  counter = g_hash_table_lookup (keyed_counters, key);
+
+  if (counter == NULL)
+  {
+    counter = g_new0 (guint64, 1);
+    g_hash_table_insert (keyed_counters, key, counter);
+  }
+  else
+  {
+    g_free (key);
+  }
+
+  *counter += n;
+}
+
+MetricsHistogram *
+metrics_histogram_lookup (const gchar *family, const gchar *name)
+{
+  MetricsHistogram *histogram;
+  gchar *key;
+
+  if (keyed_histograms == NULL)
+    keyed_histograms = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+
+  key = g_strconcat (family, ":", name, NULL);
+  histogram = g_hash_table_lookup (keyed_histograms, key);
+
+  if (histogram == NULL)
+  {
+    histogram = g_new0 (MetricsHistogram, 1);
+    g_hash_table_insert (keyed_histograms, key, histogram);
+  }
+  else
+  {
+    g_free (key);
+  }
+
+  return histogram;
+}
+
+void
+metrics_histogram_record (MetricsHistogram *histogram, gint64 usec)
+{
+  guint bucket = METRICS_NUM_BUCKETS - 1;
+
+  if (usec < ((gint64) 1 << bucket))
+    bucket = g_bit_storage (MAX (usec, 0)) - 1;
+
+  g_atomic_int_add (&histogram->buckets[bucket], 1);
+}
+
+void
+metrics_histogram_reset (MetricsHistogram *histogram)
+{
+  guint i;
+
+  for (i = 0; i < METRICS_NUM_BUCKETS; i++)
+    g_atomic_int_set (&histogram->buckets[i], 0);
+}
+
+gint64
+metrics_histogram_percentile (MetricsHistogram *histogram, guint percent)
+{
+  guint64 samples[METRICS_NUM_BUCKETS];
+  guint64 total = 0, rank, seen = 0;
+  guint i;
+
+  for (i = 0; i < METRICS_NUM_BUCKETS; i++)
+  {
+    samples[i] = (guint) g_atomic_int_get (&histogram->buckets[i]);
+    total += samples[i];
+  }
+
+  if (total == 0)
+    return 0;
+
+  rank = MAX ((total * MIN (percent, 100) + 99) / 100, 1);
+  for (i = 0; i < METRICS_NUM_BUCKETS - 1; i++)
+  {
+    seen += samples[i];
+    if (seen >= rank)
+      break;
+  }
+
+  return ((gint64) 1 << (i + 1)) - 1;
+}
+
+void
+metrics_record (MetricsHistogramId id, gint64 usec)
+{
+  g_return_if_fail (id < METRICS_NUM_HISTOGRAMS);
+
+  metrics_histogram_record (&histograms[id], usec);
+}
+
+void
+metrics_reset (void)
+{
+  guint i;
+
+  memset (counters, 0, sizeof (counters));
+  memset (messages, 0, sizeof (messages));
+
+  if (keyed_counters != NULL)
+  {
+    GHashTableIter iter;
+    gpointer counter;
+
+    g_hash_table_iter_init (&iter, keyed_counters);
+    while (g_hash_table_iter_next (&iter, NULL, &counter))
+      *(guint64 *) counter = 0;
+  }
+
+  for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++)
+    metrics_histogram_reset (&histograms[i]);
+
+  if (keyed_histograms != NULL)
+  {
+    GHashTableIter iter;
+    gpointer histogram;
+
+    g_hash_table_iter_init (&iter, keyed_histograms);
+    while (g_hash_table_iter_next (&iter, NULL, &histogram))
+      metrics_histogram_reset (histogram);
+  }
+}
+
+static void
+append_counter (DBusMessageIter *dict, const gchar *name, guint64 value)
+{
+  DBusMessageIter entry;
+  dbus_uint64_t v = value;
+
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT64, &v);
+  dbus_message_iter_close_container (dict, &entry);
+}
+
+static void
+append_histogram (DBusMessageIter *dict, const gchar *name,
+                  MetricsHistogram *histogram)
+{
+  DBusMessageIter entry, array;
+  dbus_uint64_t buckets[METRICS_NUM_BUCKETS];
+  const dbus_uint64_t *values = buckets;
+  guint i;
+
+  for (i = 0; i < METRICS_NUM_BUCKETS; i++)
+    buckets[i] = (guint) g_atomic_int_get (&histogram->buckets[i]);
+
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name);
+  dbus_message_iter_open_container (&entry, DBUS_TYPE_ARRAY,
+                                    DBUS_TYPE_UINT64_AS_STRING, &array);
+  dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_UINT64,
+                                        &values, METRICS_NUM_BUCKETS);
+  dbus_message_iter_close_container (&entry, &array);
+  dbus_message_iter_close_container (dict, &entry);
+}
+
+static void
+append_percentiles (DBusMessageIter *dict, const gchar *name,
+                    MetricsHistogram *histogram)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (percentiles); i++)
+  {
+    gchar *percentile_name = g_strdup_printf ("%s_p%u_us", name,
+                                              percentiles[i]);
+
+    append_counter (dict, percentile_name,
+                    metrics_histogram_percentile (histogram, percentiles[i]));
+    g_free (percentile_name);
+  }
+}
+
+void
+metrics_append (DBusMessage *reply)
+{
+  DBusMessageIter iter, dict;
+  GHashTableIter keyed;
+  gpointer name, counter, histogram;
+  guint i;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{st}", &dict);
+
+  for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+    append_counter (&dict, counter_names[i], counters[i]);
+
+  for (i = 0; i <= HILDON_IM_NUM_ATOMS; i++)
+  {
+    gchar *atom_name = NULL;
+    gchar *name;
+
+    if (messages[i] == 0)
+      continue;
+
+    if (i < HILDON_IM_NUM_ATOMS)
+      atom_name = XGetAtomName (GDK_DISPLAY (),
+                                hildon_im_protocol_get_atom (i));
+
+    name = g_strconcat ("client_messages:",
+                        atom_name != NULL ? atom_name : "other", NULL);
+    append_counter (&dict, name, messages[i]);
+    g_free (name);
+
+    if (atom_name != NULL)
+      XFree (atom_name);
+  }
+
+  if (keyed_counters != NULL)
+  {
+    g_hash_table_iter_init (&keyed, keyed_counters);
+    while (g_hash_table_iter_next (&keyed, &name, &counter))
+      append_counter (&dict, name, *(guint64 *) counter);
+  }
+
+  for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++)
+    append_percentiles (&dict, histogram_names[i], &histograms[i]);
+
+  if (keyed_histograms != NULL)
+  {
+    g_hash_table_iter_init (&keyed, keyed_histograms);
+    while (g_hash_table_iter_next (&keyed, &name, &histogram))
+      append_percentiles (&dict, name, histogram);
+  }
+
+  dbus_message_iter_close_container (&iter, &dict);
+
+  dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sat}", &dict);
+
+  for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++)
+    append_histogram (&dict, histogram_names[i], &histograms[i]);
+
+  if (keyed_histograms != NULL)
+  {
+    g_hash_table_iter_init (&keyed, keyed_histograms);
+    while (g_hash_table_iter_next (&keyed, &name, &histogram))
+      append_histogram (&dict, name, histogram);
+  }
+
+  dbus_message_iter_close_container (&iter, &dict);
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of hildon-input-method
+ *
+ * Copyright (C) 2007 Nokia Corporation.
+ *
+ * Contact: Mohammad Anwari <Mohammad.Anwari@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+/**
+ * Runtime metrics of hildon-input-method
+ *
+ * Counters and latency histograms kept for the lifetime of the daemon and
+ * served over D-Bus by GetMetrics on org.maemo.him. Histograms have one
+ * bucket per power of two microseconds, bucket i counting the samples in
+ * [2^i, 2^(i+1)) us, except for bucket 0 which holds [0, 2) us and the
+ * last one which also takes everything above. Counters are only touched
+ * from the main loop, histogram buckets are updated atomically.
+ */
+
+/* Set in the environment to time key events to their commits */
+#define METRICS_KEY_LATENCY_ENV "HILDON_IM_KEY_LATENCY"
+
+typedef enum
+{
+  METRICS_KEY_EVENTS,
+  METRICS_ACTIVATIONS,
+  METRICS_PLUGIN_CREATES,
+  METRICS_PLUGIN_DESTROYS,
+  METRICS_FLUSHES,
+  METRICS_SEND_EVENTS,
+  METRICS_BYTES_COMMITTED,
+  METRICS_NUM_COUNTERS
+} MetricsCounter;
+
+typedef enum
+{
+  METRICS_SHOW_LATENCY,
+  METRICS_NUM_HISTOGRAMS
+} MetricsHistogramId;
+
+#define METRICS_NUM_BUCKETS 32
+
+typedef struct
+{
+  volatile gint buckets[METRICS_NUM_BUCKETS];
+} MetricsHistogram;
+
+void metrics_count (MetricsCounter counter, guint n);
+
+/* @type is a HildonIMAtom, or HILDON_IM_NUM_ATOMS for unknown messages */
+void metrics_count_message (guint type);
+
+/* Counter @name of @family, reported by GetMetrics as "@family:@name" */
+void metrics_count_keyed (const gchar *family, const gchar *name, guint n);
+
+void metrics_record (MetricsHistogramId id, gint64 usec);
+
+/* Histogram @name of @family, created on first use and valid until exit.
+ * GetMetrics reports it as "@family:@name" */
+MetricsHistogram *metrics_histogram_lookup (const gchar *family,
+                                           const gchar *name);
+
+void metrics_histogram_record (MetricsHistogram *histogram, gint64 usec);
+void metrics_histogram_reset (MetricsHistogram *histogram);
+
+/* Upper bound in microseconds of the bucket holding the @percent-th sample,
+ * or 0 if the histogram is empty */
+gint64 metrics_histogram_percentile (MetricsHistogram *histogram,
+                                     guint percent);
+
+void metrics_reset (void);
+
+/* Appends the (a{st}a{sat}) reply of GetMetrics */
+void metrics_append (DBusMessage *reply);
+
+#endif
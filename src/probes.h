@@ -0,0 +1,65 @@
+/*
+ * This file is part of hildon-input-method
+ *
+ * Copyright (C) 2007 Nokia Corporation.
+ *
+ * Contact: Mohammad Anwari <Mohammad.Anwari@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include <glib.h>
+
+/**
+ * Static tracing probes of hildon-input-method
+ *
+ * With --enable-sdt-probes the HIM_PROBE* macros become systemtap/USDT
+ * markers of the "hildon_im" provider, which can be listed with
+ * "stap -L 'process(\"libhildon-im-ui.so\").mark(\"*\")'" or attached to
+ * with perf, bpftrace and friends. A marker is a single nop until a
+ * tracer is attached. Otherwise the macros expand to nothing and their
+ * arguments are not evaluated.
+ *
+ * Probes come in pairs named foo__entry and foo__return, the double
+ * underscore becomes a dash in the tracer's view.
+ */
+
+#ifdef HAVE_SDT_PROBES
+
+#include <sys/sdt.h>
+
+#define HIM_PROBE0(name) \
+  DTRACE_PROBE(hildon_im, name)
+#define HIM_PROBE1(name, a1) \
+  DTRACE_PROBE1(hildon_im, name, a1)
+#define HIM_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2(hildon_im, name, a1, a2)
+#define HIM_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(hildon_im, name, a1, a2, a3)
+
+#else
+
+#define HIM_PROBE0(name) G_STMT_START { } G_STMT_END
+#define HIM_PROBE1(name, a1) G_STMT_START { } G_STMT_END
+#define HIM_PROBE2(name, a1, a2) G_STMT_START { } G_STMT_END
+#define HIM_PROBE3(name, a1, a2, a3) G_STMT_START { } G_STMT_END
+
+#endif
+
+#endif
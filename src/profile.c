@@ -0,0 +1,120 @@
+/*
+ * This file is part of hildon-input-method
+ *
+ * Copyright (C) 2007 Nokia Corporation.
+ *
+ * Contact: Mohammad Anwari <Mohammad.Anwari@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+#define MAX_MARKS 32
+
+typedef struct
+{
+  const gchar *phase;
+  gint64 usec;
+} ProfileMark;
+
+static ProfileFormat profile_format = PROFILE_OFF;
+static ProfileMark marks[MAX_MARKS];
+static guint num_marks = 0;
+
+static gint64
+monotonic_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+ProfileFormat
+profile_parse_format (const gchar *value)
+{
+  if (value == NULL || *value == '\0' || strcmp (value, "0") == 0)
+    return PROFILE_OFF;
+
+  if (g_ascii_strcasecmp (value, "json") == 0)
+    return PROFILE_JSON;
+
+  return PROFILE_TABLE;
+}
+
+void
+profile_init (ProfileFormat format)
+{
+  profile_format = format;
+  num_marks = 0;
+}
+
+gboolean
+profile_enabled (void)
+{
+  return profile_format != PROFILE_OFF;
+}
+
+void
+profile_mark (const gchar *phase)
+{
+  if (profile_format == PROFILE_OFF || num_marks == MAX_MARKS)
+    return;
+
+  marks[num_marks].phase = phase;
+  marks[num_marks].usec = monotonic_usec ();
+  num_marks++;
+}
+
+void
+profile_dump (void)
+{
+  gint64 start, previous;
+  guint i;
+
+  if (profile_format == PROFILE_OFF || num_marks == 0)
+    return;
+
+  start = previous = marks[0].usec;
+
+  if (profile_format == PROFILE_JSON)
+    fprintf (stderr, "{\"phases\": [");
+  else
+    fprintf (stderr, "%-28s %10s %10s\n", "phase", "at (ms)", "took (ms)");
+
+  for (i = 0; i < num_marks; i++)
+  {
+    gint64 at = marks[i].usec - start;
+    gint64 took = marks[i].usec - previous;
+
+    if (profile_format == PROFILE_JSON)
+      fprintf (stderr, "%s\n  {\"phase\": \"%s\", \"at_us\": %" G_GINT64_FORMAT
+               ", \"took_us\": %" G_GINT64_FORMAT "}",
+               i > 0 ? "," : "", marks[i].phase, at, took);
+    else
+      fprintf (stderr, "%-28s %10.3f %10.3f\n", marks[i].phase,
+               at / 1000.0, took / 1000.0);
+
+    previous = marks[i].usec;
+  }
+
+  if (profile_format == PROFILE_JSON)
+    fprintf (stderr, "\n]}\n");
+}
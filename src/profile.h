@@ -0,0 +1,60 @@
+/*
+ * This file is part of hildon-input-method
+ *
+ * Copyright (C) 2007 Nokia Corporation.
+ *
+ * Contact: Mohammad Anwari <Mohammad.Anwari@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <glib.h>
+
+/**
+ * Startup timeline of hildon-input-method
+ *
+ * Enabled with HILDON_IM_PROFILE=table or HILDON_IM_PROFILE=json in the
+ * environment, or with the --profile[=json] command line flag. Each
+ * profile_mark() then records a monotonic timestamp under a phase name,
+ * and profile_dump() prints them to stderr with the time since main() and
+ * since the previous mark. When disabled, marks only cost a branch.
+ */
+
+#define PROFILE_ENV "HILDON_IM_PROFILE"
+
+typedef enum
+{
+  PROFILE_OFF,
+  PROFILE_TABLE,
+  PROFILE_JSON
+} ProfileFormat;
+
+void profile_init (ProfileFormat format);
+
+/* Parses the PROFILE_ENV variable value or the --profile flag argument */
+ProfileFormat profile_parse_format (const gchar *value);
+
+gboolean profile_enabled (void);
+
+/* @phase must be a static string */
+void profile_mark (const gchar *phase);
+
+void profile_dump (void);
+
+#endif